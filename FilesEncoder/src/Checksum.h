@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_SSE42
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(CHECKSUM_SSE42) && (defined(__GNUC__) || defined(__clang__))
+#define CHECKSUM_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define CHECKSUM_TARGET_SSE42
+#endif
+
+/** \brief CRC32C (Castagnoli) checksum, uses the SSE4.2 crc32 instruction when the CPU has it. */
+class Checksum
+{
+
+public:
+
+    /** \brief Continues crc over size bytes of data, the first call starts with crc = 0. */
+    static uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0)
+    {
+        crc = ~crc;
+#ifdef CHECKSUM_SSE42
+        if (hasSse42())
+            return ~crc32cSse42(data, size, crc);
+#endif
+        return ~crc32cTable(data, size, crc);
+    }
+
+private:
+
+    static uint32_t crc32cTable(const char* data, size_t size, uint32_t crc)
+    {
+        static const Table table;
+
+        for (size_t i = 0; i < size; ++i)
+            crc = table.t[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+    // Reflected Castagnoli polynomial table.
+    struct Table
+    {
+        uint32_t t[256];
+
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+                t[i] = c;
+            }
+        }
+    };
+
+#ifdef CHECKSUM_SSE42
+
+    CHECKSUM_TARGET_SSE42
+    static uint32_t crc32cSse42(const char* data, size_t size, uint32_t crc)
+    {
+#if defined(_M_X64) || defined(__x86_64__)
+        uint64_t crc64 = crc;
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            uint64_t v;
+            memcpy(&v, data, sizeof(v));
+            crc64 = _mm_crc32_u64(crc64, v);
+        }
+        crc = static_cast<uint32_t>(crc64);
+#else
+        for (; size >= 4; size -= 4, data += 4)
+        {
+            uint32_t v;
+            memcpy(&v, data, sizeof(v));
+            crc = _mm_crc32_u32(crc, v);
+        }
+#endif
+        for (; size > 0; --size, ++data)
+            crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+        return crc;
+    }
+
+    static bool hasSse42()
+    {
+#if defined(_MSC_VER)
+        static const bool has = []()
+        {
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 20)) != 0;
+        }();
+#else
+        static const bool has = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+        return has;
+    }
+
+#endif
+
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/** \brief Content defined chunking by FastCDC Gear hash and SHA-256 chunk fingerprints. */
+class Chunker
+{
+
+public:
+
+    static const size_t MIN_SIZE = 2 * 1024;
+    static const size_t AVG_SIZE = 8 * 1024;
+    static const size_t MAX_SIZE = 64 * 1024;
+
+    /** \brief Gets length of the chunk starting at data, cut points depend only on the content. */
+    static size_t cut(const char* data, size_t size)
+    {
+        if (size <= MIN_SIZE)
+            return size;
+        if (size > MAX_SIZE)
+            size = MAX_SIZE;
+
+        // Normalized chunking: a harder mask before the average size, an easier one after.
+        const size_t normal = size < AVG_SIZE ? size : AVG_SIZE;
+        const uint64_t* gear = table().t;
+
+        uint64_t hash = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; ++i)
+        {
+            hash = (hash << 1) + gear[static_cast<unsigned char>(data[i])];
+            if ((hash & MASK_S) == 0)
+                return i;
+        }
+        for (; i < size; ++i)
+        {
+            hash = (hash << 1) + gear[static_cast<unsigned char>(data[i])];
+            if ((hash & MASK_L) == 0)
+                return i;
+        }
+        return size;
+    }
+
+    /** \brief Fingerprint of a chunk, equal fingerprints stand for equal chunks. */
+    struct Digest
+    {
+        unsigned char bytes[32];
+    };
+
+    /** \brief SHA-256 fingerprint of size bytes of data, crafted collisions are out of reach unlike with fast hashes. */
+    static void fingerprint(const char* data, size_t size, Digest& digest)
+    {
+        uint32_t h[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+
+        const size_t blocks = size / 64;
+        for (size_t i = 0; i < blocks; ++i)
+            compress(h, reinterpret_cast<const unsigned char*>(data + i * 64));
+
+        // Padding: the tail, 0x80, zeros and the big endian bit length fill one or two last blocks.
+        unsigned char last[128] = {};
+        const size_t rest = size - blocks * 64;
+        if (rest > 0)
+            memcpy(last, data + blocks * 64, rest);
+        last[rest] = 0x80;
+        const size_t lastSize = rest < 56 ? 64 : 128;
+        const uint64_t bits = static_cast<uint64_t>(size) * 8;
+        for (int i = 0; i < 8; ++i)
+            last[lastSize - 1 - i] = static_cast<unsigned char>(bits >> (i * 8));
+        for (size_t i = 0; i < lastSize; i += 64)
+            compress(h, last + i);
+
+        for (int i = 0; i < 8; ++i)
+        {
+            digest.bytes[i * 4] = static_cast<unsigned char>(h[i] >> 24);
+            digest.bytes[i * 4 + 1] = static_cast<unsigned char>(h[i] >> 16);
+            digest.bytes[i * 4 + 2] = static_cast<unsigned char>(h[i] >> 8);
+            digest.bytes[i * 4 + 3] = static_cast<unsigned char>(h[i]);
+        }
+    }
+
+private:
+
+    // FastCDC masks with 15 and 11 spread bits for 8 KB average chunks.
+    static const uint64_t MASK_S = 0x0003590703530000ULL;
+    static const uint64_t MASK_L = 0x0000D90003530000ULL;
+
+    static uint32_t rotr(uint32_t x, int r)
+    {
+        return (x >> r) | (x << (32 - r));
+    }
+
+    /** \brief SHA-256 compression of a 64-byte block into the state h. */
+    static void compress(uint32_t h[8], const unsigned char* block)
+    {
+        static const uint32_t k[64] = {
+            0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+            0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+            0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+            0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+            0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+            0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+            0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+            0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+        };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = static_cast<uint32_t>(block[i * 4]) << 24 | static_cast<uint32_t>(block[i * 4 + 1]) << 16
+                | static_cast<uint32_t>(block[i * 4 + 2]) << 8 | block[i * 4 + 3];
+        for (int i = 16; i < 64; ++i)
+        {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            const uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    // Gear values are fixed by the seed, changing them moves all cut points of stored data.
+    struct Table
+    {
+        uint64_t t[256];
+
+        Table()
+        {
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            for (int i = 0; i < 256; ++i)
+            {
+                // SplitMix64.
+                uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                t[i] = z ^ (z >> 31);
+            }
+        }
+    };
+
+    static const Table& table()
+    {
+        static const Table gear;
+        return gear;
+    }
+
+};
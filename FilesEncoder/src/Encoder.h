@@ -2,9 +2,29 @@
 
 #include <vector>
 #include <queue>
+#include <array>
+#include <functional>
+#include <unordered_map>
+#include <thread>
+#include <exception>
+#include <memory>
+#include <cstdint>
+#include <cstring>
 #include "FileReader.h"
+#include "Checksum.h"
+#include "RangeCoder.h"
+#include "Chunker.h"
 #include <list>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define ENCODER_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 using namespace std;
 
 /** \brief Encoder/decoder for all type of files. */
@@ -16,61 +36,275 @@ public:
     /** \brief Encodes file with path to file with pathTo by method. */
     void encode(const string& method, const string& path, const string& pathTo)
     {
-        ICoder* c;
-
-        if (method == "haff")
-            c = new Huffman(path);
-        else if (method == "shan")
-            c = new ShannonFano(path);
-        else if (method == "lz775")
-            c = new LZ77(4 * 1024, 1 * 1024);
-        else if (method == "lz7710")
-            c = new LZ77(8 * 1024, 2 * 1024);
-        else if (method == "lz7720")
-            c = new LZ77(16 * 1024, 4 * 1024);
-        else
+        unique_ptr<ICoder> c(create(method));
+        if (!c)
             throw logic_error("No supported method to encode: " + method);
 
+        fit(*c, method, path);
         c->encode(path, pathTo);
     }
 
+    /** \brief Encodes bytes appended to file with path since the last append to the end of pathTo by method. */
+    void append(const string& method, const string& path, const string& pathTo)
+    {
+        unique_ptr<ICoder> c(create(method));
+        IAppender* a = dynamic_cast<IAppender*>(c.get());
+        if (!a)
+            throw logic_error("No supported method to append: " + method);
+
+        // Appending codes the new bytes only, so it is checked by its own estimate.
+        if (memoryLimit != SIZE_MAX)
+            check(method, a->appendUsage(path, pathTo));
+        a->append(path, pathTo);
+    }
+
     /** \brief Decodes file with path to file with pathTo by method. */
     void decode(const string& method, const string& path, const string& pathTo)
     {
-        ICoder* c;
-
-        if (method == "haff")
-            c = new Huffman(path);
-        else if (method == "shan")
-            c = new ShannonFano(path);
-        else if (method == "lz775")
-            c = new LZ77(4 * 1024, 1 * 1024);
-        else if (method == "lz7710")
-            c = new LZ77(8 * 1024, 2 * 1024);
-        else if (method == "lz7720")
-            c = new LZ77(16 * 1024, 4 * 1024);
-        else
+        unique_ptr<ICoder> c(create(method));
+        if (!c)
             throw logic_error("No supported method to decode: " + method);
 
         c->decode(path, pathTo);
     }
 
+    /**
+     * \brief Methods pick smaller windows, blocks or tables to encode within limit bytes,
+     * encoding throws if a method still needs more. Decoding takes about as much as encoding did.
+     */
+    void setMemoryLimit(size_t limit)
+    {
+        memoryLimit = limit;
+    }
+
+    /**
+     * \brief Sets the directory of stores which stages keep across files, the current directory by default.
+     * Each stage and wrapped method has a store of its own, e.g. "dedup.lz7720" for "dedup+lz7720".
+     */
+    void setStoreDirectory(const string& directory)
+    {
+        storeDirectory = directory;
+        if (!storeDirectory.empty() && storeDirectory.back() != '/' && storeDirectory.back() != '\\')
+            storeDirectory += '/';
+    }
+
+    /** \brief Estimates peak bytes taken by encoding file with path by method within the memory limit. */
+    size_t memoryUsage(const string& method, const string& path) const
+    {
+        unique_ptr<ICoder> c(create(method));
+        if (!c)
+            throw logic_error("No supported method to estimate: " + method);
+
+        const size_t size = sourceSize(*c, path);
+        c->limitMemory(memoryLimit, size);
+        return c->memoryUsage(size);
+    }
+
 private:
 
-    static char binaryToByte(string& bits)
+    // A vector grown by push_back takes up to twice its size and keeps the old buffer while it grows.
+    static const uint64_t GROWTH = 3;
+
+    /** \brief Peak bytes of coding size bytes to packed bytes or back, the larger side is grown by push_back. */
+    static uint64_t grown(uint64_t size, uint64_t packed)
+    {
+        return size < packed ? size + GROWTH * packed : packed + GROWTH * size;
+    }
+
+    /** \brief Converts estimated bytes to size_t, estimates beyond the address space saturate. */
+    static size_t saturate(uint64_t bytes)
+    {
+        return bytes > SIZE_MAX ? SIZE_MAX : static_cast<size_t>(bytes);
+    }
+
+    /** \brief Appends raw bytes of value to the end of out. */
+    template <typename T>
+    static void put(vector<char>& out, T value)
+    {
+        const char* p = reinterpret_cast<const char*>(&value);
+        out.insert(out.end(), p, p + sizeof(T));
+    }
+
+    /** \brief Reads raw bytes of value from in at pos and moves pos forward. */
+    template <typename T>
+    static T get(const vector<char>& in, size_t& pos)
+    {
+        if (in.size() < sizeof(T) || pos > in.size() - sizeof(T))
+            throw runtime_error("Unexpected end of encoded data.");
+
+        T value;
+        memcpy(&value, &in[pos], sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    /** \brief Appends value by 7 bits per byte, the high bit marks a next byte. */
+    static void putVarint(vector<char>& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    /** \brief Reads value written by putVarint from in at pos and moves pos forward. */
+    static uint64_t getVarint(const vector<char>& in, size_t& pos)
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            const unsigned char b = static_cast<unsigned char>(get<char>(in, pos));
+            value |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (b < 0x80)
+                return value;
+        }
+        throw runtime_error("Corrupted variable length number.");
+    }
+
+    // Upper bound of prefix code tables and trees in memory.
+    static const size_t CODE_TABLE_BYTES = 128 * 1024;
+
+    /** \brief Serializes prefix codes as "n\n" header followed by "code:ch\n" lines. */
+    static void writeCodeTable(const map<char, string>& codes, vector<char>& out)
+    {
+        string ser = to_string(codes.size()) + "\n";
+        for (auto& x : codes)
+        {
+            ser += x.second;
+            ser += ":";
+            ser += x.first;
+            ser += '\n';
+        }
+
+        out.insert(out.end(), ser.begin(), ser.end());
+    }
+
+    /** \brief Deserializes prefix codes written by writeCodeTable. */
+    static void readCodeTable(const vector<char>& in, size_t& pos, map<string, char>& m)
+    {
+        auto readLine = [&in, &pos]()
+        {
+            string s;
+            while (pos < in.size() && in[pos] != '\n')
+                s += in[pos++];
+            if (pos == in.size())
+                throw runtime_error("Unexpected end of code table.");
+            ++pos;
+            return s;
+        };
+
+        int n = atoi(readLine().c_str());
+        for (int j = 0; j < n; ++j)
+        {
+            string s = readLine();
+            if (s.length() < 2)
+                throw runtime_error("Corrupted code table.");
+
+            if (s[s.length() - 1] == ':' && s[s.length() - 2] != ':')
+            {
+                // Record of the '\n' symbol has one more empty line, even if it is the last record.
+                m[s.substr(0, s.length() - 1)] = '\n';
+                if (!readLine().empty())
+                    throw runtime_error("Corrupted code table.");
+            }
+            else
+                m[s.substr(0, s.length() - 2)] = s[s.length() - 1];
+        }
+    }
+
+    /**
+     * \brief Packs codes of all text symbols, the last byte is padded by zero bits.
+     * With interval > 0 the bit offset of every interval-th symbol is added to syncBits.
+     */
+    static void writeBits(const vector<char>& text, const map<char, string>& codes, vector<char>& out,
+        size_t interval = 0, vector<uint64_t>* syncBits = nullptr)
     {
-        return static_cast<char>(stoi(bits, nullptr, 2));
+        string table[256];
+        for (auto& x : codes)
+            table[static_cast<unsigned char>(x.first)] = x.second;
+
+        const size_t start = out.size();
+        unsigned int acc = 0;
+        int bits = 0;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (interval > 0 && i % interval == 0)
+                syncBits->push_back((out.size() - start) * 8 + bits);
+
+            for (char b : table[static_cast<unsigned char>(text[i])])
+            {
+                acc = (acc << 1) | (b == '1');
+                if (++bits == 8)
+                {
+                    out.push_back(static_cast<char>(acc));
+                    acc = 0;
+                    bits = 0;
+                }
+            }
+        }
+
+        if (bits > 0)
+            out.push_back(static_cast<char>(acc << (8 - bits)));
     }
 
-    static string byteToBinary(unsigned short c)
+    /** \brief Prefix code tree: node 0 is the root, leaves keep their symbol, others -1. */
+    struct CodeTree
+    {
+        vector<array<int, 2>> next;
+        vector<int> symbol;
+
+        CodeTree(const map<string, char>& m) : next(1, array<int, 2>{ { -1, -1 } }), symbol(1, -1)
+        {
+            for (auto& x : m)
+            {
+                int node = 0;
+                for (char b : x.first)
+                {
+                    if (next[node][b == '1'] < 0)
+                    {
+                        next[node][b == '1'] = static_cast<int>(next.size());
+                        next.push_back(array<int, 2>{ { -1, -1 } });
+                        symbol.push_back(-1);
+                    }
+                    node = next[node][b == '1'];
+                }
+                symbol[node] = static_cast<unsigned char>(x.second);
+            }
+        }
+    };
+
+    /** \brief Unpacks exactly count symbols to out from bit offset bit of bytes [data, data + size). */
+    static void readBits(const char* data, size_t size, uint64_t bit, size_t count, const CodeTree& tree, char* out)
     {
-        string r;
-        for (int i = 0; i < 8; ++i)
+        for (size_t i = 0; i < count; ++i)
         {
-            r = (c % 2 == 0 ? "0" : "1") + r;
-            c /= 2;
+            int node = 0;
+            do
+            {
+                if (bit >= size * 8)
+                    throw runtime_error("Unexpected end of prefix code stream.");
+
+                node = tree.next[node][(static_cast<unsigned char>(data[bit >> 3]) >> (7 - (bit & 7))) & 1];
+                ++bit;
+                if (node < 0)
+                    throw runtime_error("Corrupted prefix code stream.");
+            } while (tree.symbol[node] < 0);
+
+            out[i] = static_cast<char>(tree.symbol[node]);
         }
-        return r;
+    }
+
+    /** \brief Unpacks symbols prefix codes from in starting at pos, padding bits of the last byte are left. */
+    static void readBits(const vector<char>& in, size_t pos, uint64_t symbols, const map<string, char>& m, vector<char>& out)
+    {
+        // Every code takes one bit at least.
+        if (symbols > static_cast<uint64_t>(in.size() - pos) * 8)
+            throw runtime_error("Unexpected end of prefix code stream.");
+
+        out.resize(static_cast<size_t>(symbols));
+        readBits(in.data() + pos, in.size() - pos, 0, out.size(), CodeTree(m), out.data());
     }
 
 public:
@@ -82,10 +316,71 @@ public:
     public:
 
         /** \brief Encodes file with path to file with pathTo by method. */
-        virtual void encode(const string& path, const string& pathTo) = 0;
+        virtual void encode(const string& path, const string& pathTo)
+        {
+            vector<char> text;
+            vector<char> out;
+            FileReader::readAllBytes(path, text);
+            encode(text, out);
+            FileReader::writeAllBytes(pathTo, out);
+        }
 
         /** \brief Decodes file with path to file with pathTo by method. */
-        virtual void decode(const string& path, const string& pathTo) = 0;
+        virtual void decode(const string& path, const string& pathTo)
+        {
+            vector<char> in;
+            vector<char> out;
+            FileReader::readAllBytes(path, in);
+            decode(in, out);
+            FileReader::writeAllBytes(pathTo, out);
+        }
+
+        /** \brief Encodes bytes of text to out. */
+        virtual void encode(const vector<char>& text, vector<char>& out) = 0;
+
+        /** \brief Decodes bytes of in to out. */
+        virtual void decode(const vector<char>& in, vector<char>& out) = 0;
+
+        /** \brief Encodes bytes of text to out after its first pos bytes, so stages put their header first without a copy. */
+        virtual void encode(const vector<char>& text, vector<char>& out, size_t pos)
+        {
+            vector<char> packed;
+            encode(text, packed);
+
+            out.resize(pos);
+            out.insert(out.end(), packed.begin(), packed.end());
+        }
+
+        /** \brief Decodes bytes of in starting at pos to out, so stages skip their header without a copy. */
+        virtual void decode(const vector<char>& in, size_t pos, vector<char>& out)
+        {
+            if (pos == 0)
+            {
+                decode(in, out);
+                return;
+            }
+
+            const vector<char> tail(in.begin() + pos, in.end());
+            decode(tail, out);
+        }
+
+        /**
+         * \brief Estimates peak bytes taken by encoding size bytes of the source, the source and
+         * the encoded data included. Decoding the result takes about the same.
+         */
+        virtual size_t memoryUsage(size_t size) const
+        {
+            return saturate(grown(size, size));
+        }
+
+        /** \brief Estimates peak bytes taken by coding size bytes held in memory, as stages pass them to the wrapped coder. */
+        virtual size_t bufferUsage(size_t size) const
+        {
+            return memoryUsage(size);
+        }
+
+        /** \brief Picks smaller windows, blocks or tables to encode size bytes within limit bytes where the method has them. */
+        virtual void limitMemory(size_t /* limit */, size_t /* size */) {}
 
         virtual ~ICoder() {}
 
@@ -95,151 +390,163 @@ public:
 
     };
 
+    /** \brief Interface for encoders which continue an encoded file with new bytes of the source. */
+    class IAppender
+    {
+
+    public:
+
+        /** \brief Encodes bytes appended to file with path since the last call to the end of pathTo. */
+        virtual void append(const string& path, const string& pathTo) = 0;
+
+        /** \brief Estimates peak bytes taken by append with the same paths, which depends on the new bytes only. */
+        virtual size_t appendUsage(const string& path, const string& pathTo) const = 0;
+
+        virtual ~IAppender() {}
+
+    protected:
+
+        IAppender() {}
+
+    };
+
     /** \brief Huffman method encoder/decoder. */
     class Huffman : public ICoder
     {
 
     public:
 
-        Huffman(const string& path)
-        {
-            map<char, int> m;
-            FileReader::readSymbolsMap(path, m);
+        Huffman() {}
 
-            for (auto& x : m)
-                addNode(x.first, x.second);
+        /**
+         * \brief Adds an index of bit offsets of every syncInterval-th symbol after the code table,
+         * so slices of one stream are decoded by all hardware threads.
+         */
+        Huffman(size_t syncInterval)
+        {
+            this->syncInterval = syncInterval;
+        }
 
-            build();
+        ~Huffman()
+        {
+            clear();
         }
 
     public:
 
-        void encode(const string& path, const string& pathTo) override
+        using ICoder::encode;
+        using ICoder::decode;
+
+        void encode(const vector<char>& text, vector<char>& out) override
         {
-            vector<char> encodedText;
-            vector<char> text;
-            FileReader::readAllBytes(path, text);
+            encode(text, out, 0);
+        }
 
-            string ser = to_string(_map.size()) + "\n";
-            for (auto& x : _map)
-            {
-                ser += x.second->code;
-                ser += ":";
-                ser += x.first;
-                ser += '\n';
-            }
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            map<char, int> m;
+            FileReader::readSymbolsMap(text, m);
 
-            FileReader::writeString(pathTo, ser);
+            clear();
+            for (auto& x : m)
+                addNode(x.first, x.second);
 
-            ofstream ofs(pathTo, ios::binary | ios::ate | ios::app);
-            if (!ofs.good())
-                throw runtime_error("Can't write to file: " + pathTo);
+            if (!_queue.empty())
+                build();
 
-            // Codding.
-            string buf = "";
-            for (int i = 0; i < text.size(); ++i)
-            {
-                buf += _map[text[i]]->code;
-                while (buf.length() >= 8)
-                {
-                    char c = binaryToByte(buf.substr(0, 8));
-                    ofs.write(&c, sizeof(char));
-                    buf = buf.substr(8);
-                }
-            }
+            map<char, string> codes;
+            getCodeMap(codes);
+
+            // block look like: <code table, symbols, [interval, count, bit offsets], codes>
+            out.resize(pos);
+            writeCodeTable(codes, out);
+            put<uint64_t>(out, text.size());
 
-            if (buf.length() > 0)
+            if (syncInterval == 0)
             {
-                char c = binaryToByte(buf.substr(0, 8));
-                ofs.write(&c, sizeof(char));
+                writeBits(text, codes, out);
+                return;
             }
 
-            ofs.close();
+            vector<char> bits;
+            vector<uint64_t> syncBits;
+            writeBits(text, codes, bits, syncInterval, &syncBits);
+
+            put<uint64_t>(out, syncInterval);
+            put<uint64_t>(out, syncBits.size());
+            for (uint64_t bit : syncBits)
+                put<uint64_t>(out, bit);
+            out.insert(out.end(), bits.begin(), bits.end());
         }
 
-        void decode(const string& path, const string& pathTo) override
+        void decode(const vector<char>& in, vector<char>& out) override
         {
-            map<string, char> m;
-            vector<char> decodedText;
-
-            ifstream ifs(path, ios::binary);
-            if (!ifs.good())
-                throw runtime_error("Can't read from file: " + path);
+            decode(in, 0, out);
+        }
 
-            ofstream ofs(pathTo, ios::binary);
-            if (!ofs.good())
-                throw runtime_error("Can't write to file: " + pathTo);
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            map<string, char> m;
+            readCodeTable(in, pos, m);
+            const uint64_t symbols = get<uint64_t>(in, pos);
 
-            // Deserializing map.
-            string s;
-            char c;
-            ifs.read(&c, 1);
-            while (c != '\n')
+            if (syncInterval == 0)
             {
-                s += c;
-                ifs.read(&c, sizeof(char));
+                readBits(in, pos, symbols, m, out);
+                return;
             }
-            int n = atoi(s.c_str());
-            for (int j = 0; j < n; ++j)
-            {
-                string code;
-                char co;
-
-                s = "";
-                ifs.read(&c, sizeof(char));
-                while (c != '\n')
-                {
-                    s += c;
-                    ifs.read(&c, sizeof(char));
-                }
 
-                if (s.size() == 0)
-                {
-                    --j;
-                    continue;
-                }
-
-                if (s[s.length() - 1] == ':' && s[s.length() - 2] != ':')
-                {
-                    co = '\n';
-                    code = s.substr(0, s.length() - 1);
-                }
-                else
-                {
-                    co = s[s.length() - 1];
-                    code = s.substr(0, s.length() - 2);
-                }
+            const uint64_t interval = get<uint64_t>(in, pos);
+            const uint64_t count = get<uint64_t>(in, pos);
+            if (interval == 0 || count != (symbols + interval - 1) / interval || count > (in.size() - pos) / sizeof(uint64_t))
+                throw runtime_error("Corrupted Huffman sync index.");
 
-                m[code] = co;
-            }
+            vector<uint64_t> syncBits(static_cast<size_t>(count));
+            for (auto& bit : syncBits)
+                bit = get<uint64_t>(in, pos);
 
-            // Decode.
+            const CodeTree tree(m);
+            out.resize(static_cast<size_t>(symbols));
 
-            string code = "";
-            string buf = "";
-            int k = 0;
-            while (!ifs.eof())
+            // Each thread takes every threads-th slice, slices write disjoint parts of out.
+            const size_t threads = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), syncBits.size()));
+            vector<thread> workers;
+            vector<exception_ptr> errors(threads);
+            for (size_t t = 0; t < threads; ++t)
             {
-                ifs.read(&c, sizeof(char));
-                code.append(byteToBinary(c));
-
-                while (code.length() != 0 && k < code.length())
+                workers.emplace_back([&, t]()
                 {
-                    buf += code[k];
-                    ++k;
-                    auto it = m.find(buf);
-                    if (it != m.end())
+                    try
                     {
-                        ofs.write(&it.operator*().second, sizeof(char));
-                        buf = "";
-                        code = code.substr(k);
-                        k = 0;
+                        for (size_t k = t; k < syncBits.size(); k += threads)
+                        {
+                            const size_t first = static_cast<size_t>(k * interval);
+                            const size_t count = static_cast<size_t>(min<uint64_t>(interval, symbols - first));
+                            readBits(in.data() + pos, in.size() - pos, syncBits[k], count, tree, &out[first]);
+                        }
                     }
-                }
+                    catch (...)
+                    {
+                        errors[t] = current_exception();
+                    }
+                });
             }
 
-            ifs.close();
-            ofs.close();
+            for (auto& w : workers)
+                w.join();
+            for (auto& e : errors)
+                if (e)
+                    rethrow_exception(e);
+        }
+
+        // Codes take less than 9 bits per symbol on average, the sync index copies them once more.
+        size_t memoryUsage(size_t size) const override
+        {
+            const uint64_t bits = static_cast<uint64_t>(size) * 9 / 8;
+            uint64_t bytes = grown(size, bits) + CODE_TABLE_BYTES;
+            if (syncInterval > 0)
+                bytes += bits + (size / syncInterval + 1) * sizeof(uint64_t);
+            return saturate(bytes);
         }
 
     private:
@@ -300,7 +607,21 @@ public:
                 _queue.push(new HuffmanNode(l->quantity + r->quantity, l, r));
             }
 
-            traversal(_queue.top(), "");
+            // Single symbol still needs one bit per occurrence.
+            HuffmanNode* root = _queue.top();
+            traversal(root, root->left || root->right ? "" : "0");
+        }
+
+        /** Deletes the tree and all codes. */
+        void clear()
+        {
+            while (!_queue.empty())
+            {
+                HuffmanNode* node = _queue.top();
+                _queue.pop();
+                delete node;
+            }
+            _map.clear();
         }
 
         void addNode(char c, int quantity)
@@ -310,11 +631,6 @@ public:
             _queue.push(nNode);
         }
 
-        string getCode(char c)
-        {
-            return _map[c]->code;
-        }
-
         void getCodeMap(map<char, string>& m) const
         {
             m = map<char, string>();
@@ -326,6 +642,9 @@ public:
 
         map<char, HuffmanNode*> _map;
         priority_queue<HuffmanNode*, vector<HuffmanNode*>, Compare> _queue;
+
+    protected:
+        size_t syncInterval = 0;
     };
 
     /** \brief ShannonFano method encoder/decoder. */
@@ -333,22 +652,18 @@ public:
     {
     public:
 
-        ShannonFano(const string& path)
-        {
-            map<char, int> m;
-            FileReader::readSymbolsMap(path, m);
-
-            for (auto& x : m)
-                addNode(x.first, x.second);
-
-            build();
-        }
+        ShannonFano() {}
 
     private:
 
         void build()
         {
             fano(0, _list.size() - 1);
+
+            // Single symbol still needs one bit per occurrence.
+            if (_list.size() == 1)
+                _list[0].second = "0";
+
             for (auto& x : _list)
                 _map[x.first.second] = x.second;
         }
@@ -391,285 +706,2692 @@ public:
 
     private:
 
-        void encode(const string& path, const string& pathTo) override
-        {
-            vector<char> encodedText;
-
-            vector<char> text;
-            FileReader::readAllBytes(path, text);
+        using ICoder::encode;
+        using ICoder::decode;
 
-            // Writing map.
-            string ser = to_string(_map.size()) + "\n";
-            for (auto& x : _map)
-            {
-                ser += x.second;
-                ser += ":";
-                ser += x.first;
-                ser += '\n';
-            }
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
 
-            FileReader::writeString(pathTo, ser);
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            map<char, int> m;
+            FileReader::readSymbolsMap(text, m);
 
-            ofstream ofs(pathTo, ios::binary | ios::ate | ios::app);
-            if (!ofs.good())
-                throw runtime_error("Can't write to file: " + pathTo);
+            _list.clear();
+            _map.clear();
+            for (auto& x : m)
+                addNode(x.first, x.second);
 
-            // Encoding.
-            string buf = "";
-            for (int i = 0; i < text.size(); ++i)
-            {
-                buf += _map[text[i]];
-                while (buf.length() >= 8)
-                {
-                    char c = binaryToByte(buf.substr(0, 8));
-                    ofs.write(&c, 1);
-                    buf = buf.substr(8);
-                }
-            }
+            build();
 
-            if (buf.length() > 0)
-            {
-                char c = binaryToByte(buf.substr(0, 8));
-                ofs.write(&c, 1);
-            }
+            // block look like: <code table, symbols, codes>
+            out.resize(pos);
+            writeCodeTable(_map, out);
+            put<uint64_t>(out, text.size());
+            writeBits(text, _map, out);
+        }
 
-            ofs.close();
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
         }
 
-        void decode(const string& path, const string& pathTo) override
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
         {
             map<string, char> m;
-            vector<char> decodedText;
+            readCodeTable(in, pos, m);
+            const uint64_t symbols = get<uint64_t>(in, pos);
+            readBits(in, pos, symbols, m, out);
+        }
 
-            ifstream ifs(path, ios::binary);
-            if (!ifs.good())
-                throw runtime_error("Can't read from file: " + path);
+        // Codes take less than 10 bits per symbol on average.
+        size_t memoryUsage(size_t size) const override
+        {
+            return saturate(grown(size, static_cast<uint64_t>(size) * 10 / 8) + CODE_TABLE_BYTES);
+        }
 
-            ofstream ofs(pathTo, ios::binary);
-            if (!ofs.good())
-                throw runtime_error("Can't write to file: " + pathTo);
+    private:
 
-            // Deserializing map.
-            string s;
-            char c;
-            ifs.read(&c, 1);
-            while (c != '\n')
-            {
-                s += c;
-                ifs.read(&c, 1);
-            }
-            int n = atoi(s.c_str());
-            for (int j = 0; j < n; ++j)
-            {
-                string code;
-                char co;
+        map<char, string> _map;
+        vector< pair< pair<int, char>, string> > _list;
+    };
 
-                s = "";
-                ifs.read(&c, 1);
-                while (c != '\n')
-                {
-                    s += c;
-                    ifs.read(&c, 1);
-                }
+    /**
+     * \brief LZ77 method with specific history and preview buffer encoder/decoder.
+     * Buffer sizes are compile time constants, the history is searched by hash chains.
+     */
+    template <size_t HisBufSize, size_t PreBufSize>
+    class LZ77 : public ICoder
+    {
+        static_assert(HisBufSize > 0 && (HisBufSize & (HisBufSize - 1)) == 0, "History buffer size must be a power of two.");
+        static_assert(HisBufSize <= 32 * 1024 && PreBufSize > 0 && PreBufSize <= 0xFFFF, "LZ77 node offset and length are ushort.");
 
-                if (s.size() == 0)
-                {
-                    --j;
-                    continue;
+    public:
+
+        using ICoder::encode;
+        using ICoder::decode;
+
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+            put<size_t>(out, HisBufSize);
+
+            encodeNodes(text, 0, out);
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            get<size_t>(in, pos);
+
+            out.clear();
+            decodeNodes(in, pos, in.size(), out);
+        }
+
+        // A literal node per symbol at worst and hash chains.
+        size_t memoryUsage(size_t size) const override
+        {
+            const uint64_t node = 2 * sizeof(ushort) + 1;
+            const uint64_t chains = ((static_cast<uint64_t>(1) << HASH_BITS) + HisBufSize) * sizeof(size_t);
+            return saturate(grown(size, size * node) + chains);
+        }
+
+    protected:
+
+        /** \brief Encodes text starting at from, the text before it serves as the history. */
+        void encodeNodes(const vector<char>& text, size_t from, vector<char>& out)
+        {
+            resetChains();
+            insertChains(text, from > HisBufSize ? from - HisBufSize : 0, from);
+
+            size_t preStart = from;
+            while (preStart < text.size())
+            {
+                LZ77Node node = findNewNode(text, preStart);
+
+                put<ushort>(out, node.offs);
+                put<ushort>(out, node.len);
+                out.push_back(node.ch);
+
+                insertChains(text, preStart, preStart + node.len + 1);
+                preStart += node.len + 1;
+            }
+        }
+
+        /** \brief Decodes nodes of in[pos, end) to the end of out. */
+        static void decodeNodes(const vector<char>& in, size_t pos, size_t end, vector<char>& out)
+        {
+            // Decoded text is the history itself.
+            while (pos < end)
+            {
+                ushort offs = get<ushort>(in, pos);
+                ushort len = get<ushort>(in, pos);
+                char ch = get<char>(in, pos);
+
+                if (offs > out.size() || (offs == 0 && len != 0))
+                    throw runtime_error("Corrupted LZ77 node offset.");
+
+                size_t hisStart = out.size() - offs;
+                for (int j = 0; j < len; ++j)
+                    out.push_back(out[hisStart + j]);
+
+                out.push_back(ch);
+            }
+
+            if (pos != end)
+                throw runtime_error("Corrupted LZ77 frame.");
+        }
+
+        typedef unsigned short ushort;
+
+        // block look like:  <offs, len, ch> example: <3,2,d>
+        struct LZ77Node
+        {
+            ushort offs;
+            ushort len;
+            char ch;
+
+            LZ77Node(ushort o, ushort l, char c) : offs(o), len(l), ch(c) { }
+        };
+
+        // Chains link positions with equal hash of MIN_MATCH bytes, a slot is reused after HisBufSize positions.
+        static const size_t HASH_BITS = 15;
+        static const size_t MIN_MATCH = 3;
+        static const size_t MAX_CHAIN = HisBufSize / 64;
+        static const size_t HIS_MASK = HisBufSize - 1;
+
+        static size_t hashAt(const vector<char>& text, size_t pos)
+        {
+            const uint32_t v = static_cast<unsigned char>(text[pos])
+                | static_cast<unsigned char>(text[pos + 1]) << 8
+                | static_cast<unsigned char>(text[pos + 2]) << 16;
+            return (v * 2654435761u) >> (32 - HASH_BITS);
+        }
+
+        void resetChains()
+        {
+            head.assign(static_cast<size_t>(1) << HASH_BITS, SIZE_MAX);
+            chain.assign(HisBufSize, SIZE_MAX);
+        }
+
+        /** \brief Adds text positions [from, to) to hash chains. */
+        void insertChains(const vector<char>& text, size_t from, size_t to)
+        {
+            for (size_t i = from; i < to && i + MIN_MATCH <= text.size(); ++i)
+            {
+                const size_t h = hashAt(text, i);
+                chain[i & HIS_MASK] = head[h];
+                head[h] = i;
+            }
+        }
+
+        /** \brief Finds the longest match of the preview buffer at preStart within the history buffer. */
+        LZ77Node findNewNode(const vector<char>& text, size_t preStart) const
+        {
+            // Keep the last symbol of the text for the node literal.
+            const size_t maxLen = min(PreBufSize, text.size() - preStart - 1);
+
+            size_t maxSeqLength = 0;
+            size_t maxSeqOffs = 0;
+            if (maxLen >= MIN_MATCH)
+            {
+                const char* pre = &text[preStart];
+
+                size_t cur = head[hashAt(text, preStart)];
+                for (size_t depth = 0; cur != SIZE_MAX && preStart - cur <= HisBufSize && depth < MAX_CHAIN; ++depth)
+                {
+                    const char* his = &text[cur];
+                    if (his[maxSeqLength] == pre[maxSeqLength])
+                    {
+                        size_t readSeqLength = 0;
+                        while (readSeqLength < maxLen && his[readSeqLength] == pre[readSeqLength])
+                            ++readSeqLength;
+
+                        if (readSeqLength > maxSeqLength)
+                        {
+                            maxSeqLength = readSeqLength;
+                            maxSeqOffs = preStart - cur;
+                            if (maxSeqLength == maxLen)
+                                break;
+                        }
+                    }
+                    cur = chain[cur & HIS_MASK];
+                }
+            }
+
+            if (maxSeqLength == 0)
+                return LZ77Node(0, 0, text[preStart]);
+
+            return LZ77Node(static_cast<ushort>(maxSeqOffs), static_cast<ushort>(maxSeqLength), text[preStart + maxSeqLength]);
+        }
+
+    protected:
+        vector<size_t> head;
+        vector<size_t> chain;
+    };
+
+    /**
+     * \brief LZ77 encoded as a sequence of frames, each next frame refers to the tail of the previous
+     * data as its history. Appending keeps the consumed source length, the encoded length and the
+     * history tail in pathTo + ".state", so it costs only the new bytes. Hash chains are rebuilt
+     * from the tail.
+     */
+    template <size_t HisBufSize, size_t PreBufSize>
+    class LZ77Append : public LZ77<HisBufSize, PreBufSize>, public IAppender
+    {
+        typedef LZ77<HisBufSize, PreBufSize> Base;
+
+    public:
+
+        using Base::encode;
+        using Base::decode;
+
+        // frame look like: <rawLen, packedLen, nodes>
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+            appendFrame(text, 0, out);
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            out.clear();
+
+            while (pos < in.size())
+            {
+                const uint64_t rawLen = get<uint64_t>(in, pos);
+                const uint64_t size = get<uint64_t>(in, pos);
+                if (size > in.size() - pos)
+                    throw runtime_error("Unexpected end of encoded data.");
+
+                const size_t start = out.size();
+                this->decodeNodes(in, pos, pos + static_cast<size_t>(size), out);
+                if (out.size() - start != rawLen)
+                    throw runtime_error("Corrupted LZ77 frame.");
+
+                pos += static_cast<size_t>(size);
+            }
+        }
+
+        /** \brief Encodes the file as a single frame and starts the append state from it. */
+        void encode(const string& path, const string& pathTo) override
+        {
+            vector<char> text;
+            vector<char> out;
+            FileReader::readAllBytes(path, text);
+            encode(text, out);
+
+            // A state left from the previous content must not outlive it.
+            remove((pathTo + ".state").c_str());
+            FileReader::writeAllBytes(pathTo, out);
+            writeState(pathTo, text.size(), out.size(), text);
+        }
+
+        void append(const string& path, const string& pathTo) override
+        {
+            uint64_t consumed = 0;
+            uint64_t encoded = 0;
+            vector<char> text;
+            if (readState(pathTo, consumed, encoded, text))
+            {
+                // A frame written after the last state update is dropped and encoded again.
+                const size_t size = FileReader::fileSize(pathTo);
+                if (size < encoded)
+                    throw runtime_error("Encoded file is shorter than its append state: " + pathTo);
+                if (size > encoded)
+                    FileReader::truncateFile(pathTo, static_cast<size_t>(encoded));
+            }
+            else
+                FileReader::writeAllBytes(pathTo, vector<char>());
+
+            vector<char> added;
+            if (FileReader::readBytesFrom(path, consumed, added) < consumed)
+                throw runtime_error("Source file is shorter than already encoded: " + path);
+
+            const size_t from = text.size();
+            text.insert(text.end(), added.begin(), added.end());
+
+            vector<char> frame;
+            if (!added.empty())
+            {
+                appendFrame(text, from, frame);
+                FileReader::writeBytes(pathTo, frame);
+            }
+
+            writeState(pathTo, consumed + added.size(), encoded + frame.size(), text);
+        }
+
+        // The history tail and the new bytes make one frame, the new bytes are read apart first.
+        size_t appendUsage(const string& path, const string& pathTo) const override
+        {
+            uint64_t consumed = 0;
+            uint64_t encoded = 0;
+            vector<char> text;
+            readState(pathTo, consumed, encoded, text);
+
+            const size_t size = FileReader::fileSize(path);
+            const uint64_t added = size > consumed ? size - consumed : 0;
+            return saturate(static_cast<uint64_t>(this->memoryUsage(saturate(text.size() + added))) + added);
+        }
+
+    private:
+
+        /** \brief Reads the state of pathTo, returns false if there is none. */
+        static bool readState(const string& pathTo, uint64_t& consumed, uint64_t& encoded, vector<char>& text)
+        {
+            const string statePath = pathTo + ".state";
+            ifstream ifs(statePath, ios::binary);
+            if (!ifs.good())
+                return false;
+            ifs.close();
+
+            // State look like: <consumed source length, encoded length, history tail>
+            vector<char> state;
+            FileReader::readAllBytes(statePath, state);
+
+            size_t pos = 0;
+            consumed = get<uint64_t>(state, pos);
+            encoded = get<uint64_t>(state, pos);
+            text.assign(state.begin() + pos, state.end());
+            return true;
+        }
+
+        /** \brief Rewrites the state of pathTo through a temporary file, so it is either old or new after a crash. */
+        static void writeState(const string& pathTo, uint64_t consumed, uint64_t encoded, const vector<char>& text)
+        {
+            vector<char> state;
+            put<uint64_t>(state, consumed);
+            put<uint64_t>(state, encoded);
+            state.insert(state.end(), text.end() - min(HisBufSize, text.size()), text.end());
+
+            const string statePath = pathTo + ".state";
+            FileReader::writeAllBytes(statePath + ".tmp", state);
+            FileReader::replaceFile(statePath + ".tmp", statePath);
+        }
+
+        /** \brief Appends a frame of text from position from to out. */
+        void appendFrame(const vector<char>& text, size_t from, vector<char>& out)
+        {
+            vector<char> nodes;
+            this->encodeNodes(text, from, nodes);
+
+            put<uint64_t>(out, text.size() - from);
+            put<uint64_t>(out, nodes.size());
+            out.insert(out.end(), nodes.begin(), nodes.end());
+        }
+    };
+
+    /**
+     * \brief LZ77 with long distance matching: a rolling hash index over the whole window finds
+     * repeats far behind the short history buffer, which still serves local matches. Only positions
+     * whose hash has sampleBits() zero bits are indexed, so the index slots spread over the window
+     * and a repeat is found from its first sampled position on. Sources up to (1 << hashBits) bytes
+     * have every position indexed.
+     */
+    template <size_t HisBufSize, size_t PreBufSize>
+    class LZ77Long : public LZ77<HisBufSize, PreBufSize>
+    {
+        typedef LZ77<HisBufSize, PreBufSize> Base;
+
+    public:
+
+        /**
+         * \brief Index memory is (1 << hashBits) * 4 bytes, matches reach up to windowSize back.
+         * Larger sources have every 2^sampleBits()-th position indexed, so shorter repeats may be missed.
+         */
+        LZ77Long(size_t windowSize, size_t hashBits)
+        {
+            this->windowSize = windowSize;
+            this->hashBits = hashBits;
+        }
+
+        using Base::encode;
+        using Base::decode;
+
+        // block look like: <offs, [len], ch> with variable length offs and len, len is omitted for offs = 0.
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            if (text.size() >= UINT32_MAX)
+                throw logic_error("LZ77 long window supports files up to 4 GB.");
+
+            out.resize(pos);
+            put<uint64_t>(out, windowSize);
+
+            vector<uint32_t> index(static_cast<size_t>(1) << hashBits, UINT32_MAX);
+            const size_t sampleBits = this->sampleBits(text.size());
+            this->resetChains();
+
+            // Hash of text[hashPos, hashPos + HASH_LEN), positions before hashPos are in the index.
+            uint64_t hash = 0;
+            uint64_t outFactor = 1;
+            size_t hashPos = 0;
+            for (size_t i = 0; i < HASH_LEN && i < text.size(); ++i)
+            {
+                hash = hash * HASH_PRIME + static_cast<unsigned char>(text[i]);
+                if (i > 0)
+                    outFactor *= HASH_PRIME;
+            }
+
+            size_t preStart = 0;
+            while (preStart < text.size())
+            {
+                while (hashPos < preStart && hashPos + HASH_LEN <= text.size())
+                {
+                    if (sampled(hash, sampleBits))
+                        index[slot(hash)] = static_cast<uint32_t>(hashPos);
+                    if (hashPos + HASH_LEN < text.size())
+                        hash = (hash - static_cast<unsigned char>(text[hashPos]) * outFactor) * HASH_PRIME
+                            + static_cast<unsigned char>(text[hashPos + HASH_LEN]);
+                    ++hashPos;
+                }
+
+                const typename Base::LZ77Node node = this->findNewNode(text, preStart);
+                size_t offs = node.offs;
+                size_t len = node.len;
+                if (hashPos == preStart && preStart + HASH_LEN < text.size() && sampled(hash, sampleBits))
+                    findLongMatch(text, preStart, index[slot(hash)], offs, len);
+
+                putVarint(out, offs);
+                if (offs != 0)
+                    putVarint(out, len);
+                out.push_back(text[preStart + len]);
+
+                this->insertChains(text, preStart, preStart + len + 1);
+                preStart += len + 1;
+            }
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            get<uint64_t>(in, pos);
+
+            // Decoded text is the history itself.
+            out.clear();
+            while (pos < in.size())
+            {
+                const uint64_t offs = getVarint(in, pos);
+                const uint64_t len = offs != 0 ? getVarint(in, pos) : 0;
+                const char ch = get<char>(in, pos);
+
+                if (offs > out.size())
+                    throw runtime_error("Corrupted LZ77 node offset.");
+
+                const size_t hisStart = out.size() - static_cast<size_t>(offs);
+                for (uint64_t j = 0; j < len; ++j)
+                    out.push_back(out[hisStart + j]);
+
+                out.push_back(ch);
+            }
+        }
+
+        // 2-byte literal nodes at worst, the long index and hash chains of the short history.
+        size_t memoryUsage(size_t size) const override
+        {
+            const uint64_t index = (static_cast<uint64_t>(1) << hashBits) * sizeof(uint32_t);
+            return saturate(grown(size, 2 * static_cast<uint64_t>(size)) + index + Base::memoryUsage(0));
+        }
+
+        /** \brief Shrinks the long index, which costs only matches lost to collisions. */
+        void limitMemory(size_t limit, size_t size) override
+        {
+            while (hashBits > 16 && memoryUsage(size) > limit)
+                --hashBits;
+        }
+
+    private:
+
+        // Bytes covered by the rolling hash, also the shortest long match.
+        static const size_t HASH_LEN = 32;
+        static const uint64_t HASH_PRIME = 0x100000001B3ULL;
+
+        size_t slot(uint64_t hash) const
+        {
+            return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ULL) >> (64 - hashBits));
+        }
+
+        /** \brief Bits of the hash which must be zero to index a position: log2 of positions per slot within reach. */
+        size_t sampleBits(size_t size) const
+        {
+            const size_t reach = size < windowSize ? size : windowSize;
+
+            size_t bits = 0;
+            while (bits + hashBits < 64 && (reach >> (hashBits + bits)) > 1)
+                ++bits;
+            return bits;
+        }
+
+        /** \brief Tells if the position with hash is indexed, the bits below the slot bits decide. */
+        bool sampled(uint64_t hash, size_t bits) const
+        {
+            const uint64_t mixed = (hash * 0x9E3779B97F4A7C15ULL) << hashBits;
+            return bits == 0 || (mixed >> (64 - bits)) == 0;
+        }
+
+        /** \brief Verifies and extends the indexed candidate, takes it only if it is longer than the match in offs and len. */
+        void findLongMatch(const vector<char>& text, size_t preStart, uint32_t candidate, size_t& offs, size_t& len) const
+        {
+            if (candidate == UINT32_MAX || preStart - candidate > windowSize)
+                return;
+
+            // Keep the last symbol of the text for the node literal.
+            const size_t maxLen = text.size() - preStart - 1;
+            size_t l = 0;
+            while (l < maxLen && text[candidate + l] == text[preStart + l])
+                ++l;
+
+            if (l < HASH_LEN || l <= len)
+                return;
+
+            offs = preStart - candidate;
+            len = l;
+        }
+
+    protected:
+        size_t windowSize;
+        size_t hashBits;
+    };
+
+    /**
+     * \brief Burrows-Wheeler block sorting method: SA-IS suffix array, move-to-front,
+     * zero-run coding and Huffman codes for each block.
+     */
+    class BWT : public ICoder
+    {
+
+    public:
+
+        /** \brief Block size is limited by 24-bit row links of the inverse transform. */
+        BWT(size_t blockSize = 1024 * 1024)
+        {
+            if (blockSize == 0 || blockSize >= (1 << 24))
+                throw logic_error("BWT block size must be in (0, 16 MB).");
+            this->blockSize = blockSize;
+        }
+
+        using ICoder::encode;
+        using ICoder::decode;
+
+        // block look like: <rawLen, primary, runsLen, packedLen, Huffman packed runs>
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+
+            vector<int> s;
+            vector<int> sa;
+            vector<char> last;
+            vector<char> runs;
+            vector<char> packed;
+            for (size_t start = 0; start < text.size(); start += blockSize)
+            {
+                const int n = static_cast<int>(min(blockSize, text.size() - start));
+                const char* block = &text[start];
+
+                // Symbols are shifted by one to give the unique smallest sentinel.
+                s.resize(n + 1);
+                for (int i = 0; i < n; ++i)
+                    s[i] = static_cast<unsigned char>(block[i]) + 1;
+                s[n] = 0;
+
+                sa.resize(n + 1);
+                suffixArray(&s[0], &sa[0], n + 1, 257);
+
+                uint32_t primary = 0;
+                last.clear();
+                for (int i = 0; i <= n; ++i)
+                {
+                    if (sa[i] == 0)
+                        primary = i;
+                    else
+                        last.push_back(block[sa[i] - 1]);
+                }
+
+                moveToFront(last);
+                zeroRunEncode(last, runs);
+                Huffman().encode(runs, packed);
+
+                put<uint32_t>(out, n);
+                put<uint32_t>(out, primary);
+                put<uint32_t>(out, static_cast<uint32_t>(runs.size()));
+                put<uint32_t>(out, static_cast<uint32_t>(packed.size()));
+                out.insert(out.end(), packed.begin(), packed.end());
+            }
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            out.clear();
+
+            vector<char> packed;
+            vector<char> runs;
+            vector<char> last;
+            vector<uint32_t> links;
+            while (pos < in.size())
+            {
+                const uint32_t n = get<uint32_t>(in, pos);
+                const uint32_t primary = get<uint32_t>(in, pos);
+                const uint32_t runsLen = get<uint32_t>(in, pos);
+                const uint32_t size = get<uint32_t>(in, pos);
+
+                if (size > in.size() - pos || n >= (1 << 24) || primary > n)
+                    throw runtime_error("Corrupted BWT block header.");
+
+                packed.assign(in.begin() + pos, in.begin() + pos + size);
+                pos += size;
+
+                Huffman().decode(packed, runs);
+                if (runs.size() != runsLen)
+                    throw runtime_error("Corrupted BWT block.");
+
+                zeroRunDecode(runs, last);
+                if (last.size() != n)
+                    throw runtime_error("Corrupted BWT block.");
+
+                moveToFrontDecode(last);
+
+                const size_t start = out.size();
+                out.resize(start + n);
+                inverse(last, primary, links, n == 0 ? nullptr : &out[start]);
+            }
+        }
+
+        // A block takes about 16 bytes per symbol for suffix sorting with SA-IS recursion.
+        size_t memoryUsage(size_t size) const override
+        {
+            const uint64_t block = size < blockSize ? size : blockSize;
+            return saturate(grown(size, static_cast<uint64_t>(size) * 9 / 8) + 16 * block + CODE_TABLE_BYTES);
+        }
+
+        /** \brief Halves the block down to 64 KB, smaller blocks find less context. */
+        void limitMemory(size_t limit, size_t size) override
+        {
+            while (blockSize > 64 * 1024 && memoryUsage(size) > limit)
+                blockSize /= 2;
+        }
+
+    private:
+
+        static const unsigned char RUNA = 0;
+        static const unsigned char RUNB = 1;
+        static const unsigned char ESCAPE = 255;
+
+        /**
+         * \brief SA-IS linear time suffix array of s with n symbols in [0, k),
+         * s[n - 1] must be the unique smallest symbol.
+         */
+        static void suffixArray(const int* s, int* sa, int n, int k)
+        {
+            // S-type suffixes are smaller than the next one.
+            vector<bool> t(n);
+            t[n - 1] = true;
+            for (int i = n - 2; i >= 0; --i)
+                t[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && t[i + 1]);
+
+            auto isLMS = [&t](int i) { return i > 0 && t[i] && !t[i - 1]; };
+
+            vector<int> bucket(k);
+            auto buckets = [&](bool end)
+            {
+                fill(bucket.begin(), bucket.end(), 0);
+                for (int i = 0; i < n; ++i)
+                    ++bucket[s[i]];
+
+                int sum = 0;
+                for (int i = 0; i < k; ++i)
+                {
+                    sum += bucket[i];
+                    bucket[i] = end ? sum : sum - bucket[i];
+                }
+            };
+
+            auto induce = [&]()
+            {
+                buckets(false);
+                for (int i = 0; i < n; ++i)
+                {
+                    const int j = sa[i] - 1;
+                    if (sa[i] > 0 && !t[j])
+                        sa[bucket[s[j]]++] = j;
+                }
+
+                buckets(true);
+                for (int i = n - 1; i >= 0; --i)
+                {
+                    const int j = sa[i] - 1;
+                    if (sa[i] > 0 && t[j])
+                        sa[--bucket[s[j]]] = j;
+                }
+            };
+
+            // Sort LMS substrings.
+            buckets(true);
+            fill(sa, sa + n, -1);
+            for (int i = 1; i < n; ++i)
+                if (isLMS(i))
+                    sa[--bucket[s[i]]] = i;
+            induce();
+
+            int n1 = 0;
+            for (int i = 0; i < n; ++i)
+                if (isLMS(sa[i]))
+                    sa[n1++] = sa[i];
+
+            // Name LMS substrings, equal substrings share a name.
+            fill(sa + n1, sa + n, -1);
+            int name = 0;
+            int prev = -1;
+            for (int i = 0; i < n1; ++i)
+            {
+                const int cur = sa[i];
+                bool diff = false;
+                for (int d = 0; d < n; ++d)
+                {
+                    if (prev == -1 || s[cur + d] != s[prev + d] || t[cur + d] != t[prev + d])
+                    {
+                        diff = true;
+                        break;
+                    }
+                    if (d > 0 && (isLMS(cur + d) || isLMS(prev + d)))
+                        break;
+                }
+
+                if (diff)
+                {
+                    ++name;
+                    prev = cur;
+                }
+                sa[n1 + cur / 2] = name - 1;
+            }
+            for (int i = n - 1, j = n - 1; i >= n1; --i)
+                if (sa[i] >= 0)
+                    sa[j--] = sa[i];
+
+            // Sort LMS suffixes by the reduced string, recursively if names repeat.
+            int* sa1 = sa;
+            int* s1 = sa + n - n1;
+            if (name < n1)
+                suffixArray(s1, sa1, n1, name);
+            else
+                for (int i = 0; i < n1; ++i)
+                    sa1[s1[i]] = i;
+
+            // Induce all suffixes from sorted LMS suffixes.
+            buckets(true);
+            for (int i = 1, j = 0; i < n; ++i)
+                if (isLMS(i))
+                    s1[j++] = i;
+            for (int i = 0; i < n1; ++i)
+                sa1[i] = s1[sa1[i]];
+            fill(sa + n1, sa + n, -1);
+            for (int i = n1 - 1; i >= 0; --i)
+            {
+                const int j = sa[i];
+                sa[i] = -1;
+                sa[--bucket[s[j]]] = j;
+            }
+            induce();
+        }
+
+        /**
+         * \brief Inverse transform of last column with sentinel row primary.
+         * Each link keeps the row symbol next to the row index, so a step touches one cache line.
+         */
+        static void inverse(const vector<char>& last, uint32_t primary, vector<uint32_t>& links, char* out)
+        {
+            const uint32_t n = static_cast<uint32_t>(last.size());
+
+            // Row 0 is the sentinel rotation, the others follow by symbol.
+            uint32_t first[256] = {};
+            for (char c : last)
+                ++first[static_cast<unsigned char>(c)];
+            for (uint32_t c = 0, sum = 1; c < 256; ++c)
+            {
+                const uint32_t count = first[c];
+                first[c] = sum;
+                sum += count;
+            }
+
+            links.resize(n + 1);
+            links[0] = primary << 8;
+            for (uint32_t j = 0; j <= n; ++j)
+            {
+                if (j == primary)
+                    continue;
+                const unsigned char c = static_cast<unsigned char>(last[j < primary ? j : j - 1]);
+                links[first[c]++] = (j << 8) | c;
+            }
+
+            uint32_t row = links[0] >> 8;
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                const uint32_t link = links[row];
+                out[i] = static_cast<char>(link & 0xFF);
+                row = link >> 8;
+            }
+        }
+
+        static void moveToFront(vector<char>& data)
+        {
+            unsigned char order[256];
+            for (int i = 0; i < 256; ++i)
+                order[i] = static_cast<unsigned char>(i);
+
+            for (char& c : data)
+            {
+                const unsigned char v = static_cast<unsigned char>(c);
+                int i = 0;
+                while (order[i] != v)
+                    ++i;
+                memmove(order + 1, order, i);
+                order[0] = v;
+                c = static_cast<char>(i);
+            }
+        }
+
+        static void moveToFrontDecode(vector<char>& data)
+        {
+            unsigned char order[256];
+            for (int i = 0; i < 256; ++i)
+                order[i] = static_cast<unsigned char>(i);
+
+            for (char& c : data)
+            {
+                const unsigned char i = static_cast<unsigned char>(c);
+                const unsigned char v = order[i];
+                memmove(order + 1, order, i);
+                order[0] = v;
+                c = static_cast<char>(v);
+            }
+        }
+
+        /**
+         * \brief Zero runs become bijective base-2 digits RUNA/RUNB,
+         * other ranks are shifted by one with ESCAPE for the two largest.
+         */
+        static void zeroRunEncode(const vector<char>& mtf, vector<char>& runs)
+        {
+            runs.clear();
+
+            size_t run = 0;
+            for (size_t i = 0; i <= mtf.size(); ++i)
+            {
+                const unsigned char v = i < mtf.size() ? static_cast<unsigned char>(mtf[i]) : 1;
+                if (v == 0)
+                {
+                    ++run;
+                    continue;
+                }
+
+                while (run > 0)
+                {
+                    runs.push_back(static_cast<char>(run & 1 ? RUNA : RUNB));
+                    run = (run - 1) >> 1;
+                }
+
+                if (i == mtf.size())
+                    break;
+
+                if (v + 1 < ESCAPE)
+                    runs.push_back(static_cast<char>(v + 1));
+                else
+                {
+                    runs.push_back(static_cast<char>(ESCAPE));
+                    runs.push_back(static_cast<char>(v));
+                }
+            }
+        }
+
+        static void zeroRunDecode(const vector<char>& runs, vector<char>& mtf)
+        {
+            mtf.clear();
+
+            size_t run = 0;
+            size_t weight = 1;
+            for (size_t i = 0; i < runs.size(); ++i)
+            {
+                const unsigned char v = static_cast<unsigned char>(runs[i]);
+                if (v == RUNA || v == RUNB)
+                {
+                    run += v == RUNA ? weight : 2 * weight;
+                    weight <<= 1;
+                    continue;
+                }
+
+                mtf.insert(mtf.end(), run, 0);
+                run = 0;
+                weight = 1;
+
+                if (v != ESCAPE)
+                    mtf.push_back(static_cast<char>(v - 1));
+                else if (++i < runs.size())
+                    mtf.push_back(runs[i]);
+                else
+                    throw runtime_error("Corrupted BWT zero runs.");
+            }
+
+            mtf.insert(mtf.end(), run, 0);
+        }
+
+    protected:
+        size_t blockSize;
+    };
+
+    /**
+     * \brief One pass adaptive order-0 method: a binary range coder with probabilities updated
+     * by both sides in lockstep, so there is no table header and input may come from a pipe.
+     */
+    class Adaptive : public ICoder
+    {
+
+    public:
+
+        using ICoder::encode;
+        using ICoder::decode;
+
+        void encode(const string& path, const string& pathTo) override
+        {
+            ifstream ifs(path, ios::binary);
+            if (!ifs.good())
+                throw runtime_error("Can't read from file: " + path);
+
+            ofstream ofs(pathTo, ios::binary);
+            if (!ofs.good())
+                throw runtime_error("Can't write to file: " + pathTo);
+
+            encode(ifs, ofs);
+        }
+
+        void decode(const string& path, const string& pathTo) override
+        {
+            ifstream ifs(path, ios::binary);
+            if (!ifs.good())
+                throw runtime_error("Can't read from file: " + path);
+
+            ofstream ofs(pathTo, ios::binary);
+            if (!ofs.good())
+                throw runtime_error("Can't write to file: " + pathTo);
+
+            decode(ifs, ofs);
+        }
+
+        /** \brief Encodes bytes of is until its end to os, keeping only one chunk in memory. */
+        void encode(istream& is, ostream& os)
+        {
+            vector<char> out;
+            RangeEncoder rc(out);
+            Model model;
+
+            vector<char> chunk(CHUNK_SIZE);
+            size_t n;
+            do
+            {
+                is.read(&chunk[0], chunk.size());
+                n = static_cast<size_t>(is.gcount());
+                encodeChunk(rc, model, chunk.data(), n);
+
+                os.write(out.data(), out.size());
+                out.clear();
+            } while (n > 0);
+
+            rc.flush();
+            os.write(out.data(), out.size());
+        }
+
+        /** \brief Decodes bytes of is to os, chunk by chunk. */
+        void decode(istream& is, ostream& os)
+        {
+            RangeDecoder rc(is);
+            Model model;
+
+            vector<char> chunk(CHUNK_SIZE);
+            while (size_t n = decodeChunk(rc, model, chunk.data()))
+                os.write(chunk.data(), n);
+        }
+
+        // chunk look like: <32-bit length, symbols>, zero length ends the stream.
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+            RangeEncoder rc(out);
+            Model model;
+
+            for (size_t start = 0; start < text.size(); start += CHUNK_SIZE)
+            {
+                const size_t n = text.size() - start;
+                encodeChunk(rc, model, &text[start], n < CHUNK_SIZE ? n : CHUNK_SIZE);
+            }
+            encodeChunk(rc, model, nullptr, 0);
+
+            rc.flush();
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            out.clear();
+            RangeDecoder rc(in.data() + pos, in.size() - pos);
+            Model model;
+
+            vector<char> chunk(CHUNK_SIZE);
+            while (size_t n = decodeChunk(rc, model, chunk.data()))
+                out.insert(out.end(), chunk.begin(), chunk.begin() + n);
+        }
+
+        // Files are coded as streams: a chunk, its grown code, the decoder and file buffers whatever the size is.
+        size_t memoryUsage(size_t /* size */) const override
+        {
+            return 6 * CHUNK_SIZE;
+        }
+
+        // Bytes in memory are coded at once, the code is about as large as the source, decoding adds a chunk.
+        size_t bufferUsage(size_t size) const override
+        {
+            return saturate(grown(size, size) + CHUNK_SIZE);
+        }
+
+    private:
+
+        static const size_t CHUNK_SIZE = 64 * 1024;
+
+        /**
+         * \brief Bit tree of a byte: node 1 is the root, node * 2 + bit is the child. Each node keeps a fast
+         * and a slow adapting probability of zero with 16-bit precision, the coder takes their average.
+         */
+        struct Model
+        {
+            uint16_t fast[256];
+            uint16_t slow[256];
+
+            Model()
+            {
+                fill(fast, fast + 256, static_cast<uint16_t>(1 << 15));
+                fill(slow, slow + 256, static_cast<uint16_t>(1 << 15));
+            }
+
+            /** \brief Probability of zero at node for the range coder, within (0, 1 << PROB_BITS). */
+            uint32_t p(unsigned int node) const
+            {
+                const uint32_t mixed = (static_cast<uint32_t>(fast[node]) + slow[node]) >> (17 - RangeEncoder::PROB_BITS);
+                return mixed < 1 ? 1 : mixed > (1 << RangeEncoder::PROB_BITS) - 1 ? (1 << RangeEncoder::PROB_BITS) - 1 : mixed;
+            }
+
+            void update(unsigned int node, int bit)
+            {
+                if (bit == 0)
+                {
+                    fast[node] += (0xFFFF - fast[node]) >> FAST_SHIFT;
+                    slow[node] += (0xFFFF - slow[node]) >> SLOW_SHIFT;
+                }
+                else
+                {
+                    fast[node] -= fast[node] >> FAST_SHIFT;
+                    slow[node] -= slow[node] >> SLOW_SHIFT;
+                }
+            }
+        };
+
+        static void encodeChunk(RangeEncoder& rc, Model& model, const char* data, size_t n)
+        {
+            rc.encodeDirect(static_cast<uint32_t>(n), 32);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const unsigned char c = static_cast<unsigned char>(data[i]);
+                unsigned int node = 1;
+                for (int b = 7; b >= 0; --b)
+                {
+                    const int bit = (c >> b) & 1;
+                    rc.encodeBit(bit, model.p(node));
+                    model.update(node, bit);
+                    node = node * 2 + bit;
                 }
+            }
+        }
+
+        static size_t decodeChunk(RangeDecoder& rc, Model& model, char* data)
+        {
+            const size_t n = rc.decodeDirect(32);
+            if (n > CHUNK_SIZE)
+                throw runtime_error("Corrupted adaptive chunk length.");
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                unsigned int node = 1;
+                while (node < 256)
+                {
+                    const int bit = rc.decodeBit(model.p(node));
+                    model.update(node, bit);
+                    node = node * 2 + bit;
+                }
+                data[i] = static_cast<char>(node - 256);
+            }
+            return n;
+        }
+
+        // Adaptation rates, 1 / 2^shift of the distance to the seen bit: the fast one follows local
+        // changes, the slow one gives stationary data a precise estimate.
+        static const int FAST_SHIFT = 3;
+        static const int SLOW_SHIFT = 7;
+    };
+
+    /**
+     * \brief Context mixing method: bitwise order-0/1 direct, order-2/3/4/6 and word hashed predictors
+     * and a match model are mixed in the logistic domain, refined by an SSE stage and drive
+     * the binary range coder. Hashed tables keep probabilities in 16-slot buckets, one bucket per nibble,
+     * so each order costs two cache misses per byte and speed doesn't depend on the data much.
+     */
+    class ContextMix : public ICoder
+    {
+
+    public:
+
+        /** \brief Model takes at most memoryLimit bytes besides the text itself, the smallest model takes about 1 MB. */
+        ContextMix(size_t memoryLimit = 64 * 1024 * 1024)
+        {
+            hashBits = MIN_BITS;
+            while (hashBits < MAX_BITS && memoryFor(hashBits + 1) <= memoryLimit)
+                ++hashBits;
+        }
+
+        using ICoder::encode;
+        using ICoder::decode;
+
+        // block look like: <rawLen, hashBits, range coded bits>
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+            put<uint64_t>(out, text.size());
+            put<uint8_t>(out, static_cast<uint8_t>(hashBits));
+
+            unique_ptr<Model> model(new Model(hashBits));
+            RangeEncoder rc(out);
+            for (char ch : text)
+            {
+                const unsigned char c = static_cast<unsigned char>(ch);
+                for (int b = 7; b >= 0; --b)
+                {
+                    const int bit = (c >> b) & 1;
+                    rc.encodeBit(bit, 4096 - model->predict());
+                    model->update(bit);
+                }
+            }
+            rc.flush();
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            const uint64_t rawLen = get<uint64_t>(in, pos);
+            const size_t bits = get<uint8_t>(in, pos);
+            if (bits < MIN_BITS || bits > MAX_BITS)
+                throw runtime_error("Corrupted context mixing header.");
+
+            out.clear();
+            out.reserve(static_cast<size_t>(rawLen));
+
+            unique_ptr<Model> model(new Model(bits));
+            RangeDecoder rc(in.data() + pos, in.size() - pos);
+            for (uint64_t i = 0; i < rawLen; ++i)
+            {
+                int c = 1;
+                while (c < 256)
+                {
+                    const int bit = rc.decodeBit(4096 - model->predict());
+                    model->update(bit);
+                    c = c * 2 + bit;
+                }
+                out.push_back(static_cast<char>(c - 256));
+            }
+        }
+
+        // The result is about as large as the source.
+        size_t memoryUsage(size_t size) const override
+        {
+            return saturate(grown(size, size) + memoryFor(hashBits));
+        }
+
+        /** \brief Shrinks hashed tables and the match window. */
+        void limitMemory(size_t limit, size_t size) override
+        {
+            while (hashBits > MIN_BITS && memoryUsage(size) > limit)
+                --hashBits;
+        }
+
+    private:
+
+        static const int HASHED = 5;
+        static const int INPUTS = HASHED + 4;
+        static const int MIN_LEN = 6;
+        static const size_t MIN_BITS = 16;
+        static const size_t MAX_BITS = 28;
+
+        /** \brief Bytes taken by the model: hashed tables, match window with its index and fixed tables. */
+        static size_t memoryFor(size_t bits)
+        {
+            const size_t slots = static_cast<size_t>(1) << bits;
+            return slots * (sizeof(uint16_t) * HASHED + 1 + sizeof(uint32_t) / 4) + 256 * 256 * sizeof(uint16_t);
+        }
+
+        /** \brief Logistic function of d / 256 scaled to 12 bits, d in [-2047, 2047]. */
+        static int squash(int d)
+        {
+            static const int t[33] =
+            {
+                1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546, 2047,
+                2549, 2994, 3348, 3607, 3785, 3901, 3975, 4022, 4050, 4068, 4079, 4085, 4089, 4092, 4093, 4094
+            };
+
+            if (d > 2047)
+                return 4095;
+            if (d < -2047)
+                return 1;
+
+            const int w = d & 127;
+            d = (d >> 7) + 16;
+            return (t[d] * (128 - w) + t[d + 1] * w + 64) >> 7;
+        }
+
+        /** \brief Inverse of squash for 12 bit probabilities. */
+        static int stretch(int p)
+        {
+            struct Table
+            {
+                short t[4096];
+
+                Table()
+                {
+                    int pi = 0;
+                    for (int x = -2047; x <= 2047; ++x)
+                    {
+                        const int v = squash(x);
+                        for (int j = pi; j <= v; ++j)
+                            t[j] = static_cast<short>(x);
+                        pi = v + 1;
+                    }
+                    for (int j = pi; j < 4096; ++j)
+                        t[j] = 2047;
+                }
+            };
+
+            static const Table table;
+            return table.t[p];
+        }
+
+        /** \brief Slot keeps 12 bit probability and 4 bit hit count, new contexts adapt faster. */
+        static void train(uint16_t& slot, int bit)
+        {
+            static const int RATES[16] = { 32768, 21845, 16384, 13107, 10923, 8192, 6554, 5461, 4096, 3277, 2731, 2341, 2048, 2048, 2048, 2048 };
+
+            int p = slot >> 4;
+            const int n = slot & 15;
+            p += (((bit << 12) - p) * RATES[n]) >> 16;
+            if (p < 1)
+                p = 1;
+            else if (p > 4095)
+                p = 4095;
+            slot = static_cast<uint16_t>(p << 4 | (n < 15 ? n + 1 : n));
+        }
+
+        struct Model
+        {
+            vector<uint16_t> o0;
+            vector<uint16_t> o1;
+            vector<uint16_t> hashed[HASHED];
+            vector<int> weights;
+            vector<int> apm;
+
+            uint32_t mask;
+            uint32_t c0 = 1;
+            uint32_t nibble = 1;
+            int bitPos = 0;
+            uint64_t history = 0;
+            uint32_t word = 0;
+
+            uint32_t contexts[HASHED];
+            uint32_t buckets[HASHED];
+            uint16_t* probs[HASHED + 2];
+            int inputs[INPUTS];
+            int* w = nullptr;
+            int pr = 2048;
+            int final = 2048;
+            size_t apmIndex = 0;
+            int apmWeight = 0;
+
+            // Match model: the last occurrence of MIN_LEN bytes context predicts the next byte.
+            vector<char> window;
+            vector<uint32_t> matches;
+            uint16_t matchProbs[64];
+            uint32_t windowMask;
+            uint32_t matchShift;
+            uint64_t pos = 0;
+            uint64_t matchPtr = 0;
+            uint32_t matchLen = 0;
+            int expected = 0;
+            uint16_t* matchProb = nullptr;
+
+            Model(size_t hashBits) : o0(256, 1 << 15), o1(256 * 256, 1 << 15), weights(512 * INPUTS, 1 << 14),
+                window(static_cast<size_t>(1) << hashBits), matches(static_cast<size_t>(1) << (hashBits - 2))
+            {
+                mask = static_cast<uint32_t>((static_cast<size_t>(1) << hashBits) - 1);
+                for (auto& t : hashed)
+                    t.assign(static_cast<size_t>(mask) + 1, 1 << 15);
+
+                apm.resize(256 * 33);
+                for (size_t i = 0; i < apm.size(); ++i)
+                    apm[i] = squash((static_cast<int>(i % 33) - 16) * 128) * 16;
+
+                windowMask = mask;
+                matchShift = static_cast<uint32_t>(64 - (hashBits - 2));
+                fill(matchProbs, matchProbs + 64, 1 << 15);
+                fill(contexts, contexts + HASHED, 0);
+                findBuckets();
+            }
+
+            /** \brief Probability of the next bit to be 1, 12 bits in [1, 4095]. */
+            int predict()
+            {
+                probs[0] = &o0[c0];
+                probs[1] = &o1[(history & 0xFF) << 8 | c0];
+                for (int i = 0; i < HASHED; ++i)
+                    probs[i + 2] = &hashed[i][buckets[i] + nibble];
+
+                w = &weights[((matchLen > 0 ? 256 : 0) + c0) * INPUTS];
+                int64_t dot = 0;
+                for (int i = 0; i < HASHED + 2; ++i)
+                {
+                    inputs[i] = stretch(*probs[i] >> 4);
+                    dot += static_cast<int64_t>(inputs[i]) * w[i];
+                }
+
+                inputs[HASHED + 2] = 0;
+                matchProb = nullptr;
+                if (matchLen > 0)
+                {
+                    expected = (static_cast<unsigned char>(window[matchPtr & windowMask]) | 256) >> (7 - bitPos) & 1;
+                    matchProb = &matchProbs[(matchLen < 32 ? matchLen : 31) * 2 + expected];
+                    const int st = stretch(*matchProb >> 4);
+                    inputs[HASHED + 2] = expected ? st : -st;
+                    dot += static_cast<int64_t>(inputs[HASHED + 2]) * w[HASHED + 2];
+                }
+
+                inputs[HASHED + 3] = 256;
+                dot += static_cast<int64_t>(256) * w[HASHED + 3];
+
+                pr = squash(static_cast<int>(dot >> 16));
+
+                // Secondary estimation refines the mixed probability by the partial byte.
+                const int d = stretch(pr) + 2048;
+                apmWeight = d & 127;
+                apmIndex = static_cast<size_t>(c0) * 33 + (d >> 7);
+                const int refined = (apm[apmIndex] * (128 - apmWeight) + apm[apmIndex + 1] * apmWeight) >> 11;
+                final = (pr + refined + 1) >> 1;
+                if (final < 1)
+                    final = 1;
+                else if (final > 4095)
+                    final = 4095;
+                return final;
+            }
+
+            void update(int bit)
+            {
+                // Mixer learns towards the coded bit.
+                const int err = ((bit << 12) - pr) * 12;
+                for (int i = 0; i < INPUTS; ++i)
+                    w[i] += (inputs[i] * err + 0x8000) >> 16;
+
+                for (uint16_t* p : probs)
+                    train(*p, bit);
+
+                const int target = bit << 16;
+                apm[apmIndex] += (target - apm[apmIndex]) * (128 - apmWeight) >> 13;
+                apm[apmIndex + 1] += (target - apm[apmIndex + 1]) * apmWeight >> 13;
+
+                if (matchProb)
+                {
+                    train(*matchProb, bit == expected);
+                    if (bit != expected)
+                        matchLen = 0;
+                }
+
+                c0 = c0 * 2 + bit;
+                nibble = nibble * 2 + bit;
+                if (++bitPos == 8)
+                {
+                    nextByte(static_cast<unsigned char>(c0));
+                    c0 = 1;
+                    bitPos = 0;
+                }
+
+                if (bitPos == 0 || bitPos == 4)
+                {
+                    nibble = 1;
+                    findBuckets();
+                }
+            }
+
+            void nextByte(unsigned char c)
+            {
+                history = history << 8 | c;
+                window[pos & windowMask] = static_cast<char>(c);
+                ++pos;
+
+                if (matchLen > 0)
+                {
+                    ++matchPtr;
+                    if (matchLen < 0xFFFF)
+                        ++matchLen;
+                }
+
+                // Look for a new match, candidates are verified against the history.
+                const uint64_t key = history & ((static_cast<uint64_t>(1) << (8 * MIN_LEN)) - 1);
+                uint32_t& slot = matches[static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> matchShift)];
+                const uint32_t distance = static_cast<uint32_t>(pos) - slot;
+                if (matchLen == 0 && slot > 0 && distance < windowMask && distance < pos)
+                {
+                    const uint64_t candidate = pos - distance;
+                    uint32_t len = 0;
+                    while (len < 8 && len < candidate && static_cast<unsigned char>(window[(candidate - 1 - len) & windowMask]) == ((history >> (8 * len)) & 0xFF))
+                        ++len;
+                    if (len >= static_cast<uint32_t>(MIN_LEN))
+                    {
+                        matchLen = len;
+                        matchPtr = candidate;
+                    }
+                }
+                slot = static_cast<uint32_t>(pos);
+
+                // Unigram word context: letters since the last non letter, case folded.
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+                    word = (word + (c | 0x20) + 1) * 0x01000193u;
+                else
+                    word = 0;
+                contexts[HASHED - 1] = word * 0x9E3779B1u;
+
+                static const int ORDERS[HASHED - 1] = { 2, 3, 4, 6 };
+                for (int i = 0; i < HASHED - 1; ++i)
+                {
+                    const uint64_t h = (history & ((static_cast<uint64_t>(1) << (8 * ORDERS[i])) - 1)) * 0x9E3779B97F4A7C15ULL;
+                    contexts[i] = static_cast<uint32_t>(h >> 32) + ORDERS[i] * 0x2F0F3A1Bu;
+                }
+            }
+
+            /** \brief Buckets of the current nibble, the second nibble bucket depends on the first one. */
+            void findBuckets()
+            {
+                for (int i = 0; i < HASHED; ++i)
+                    buckets[i] = ((contexts[i] + c0 * 0x6F4F2A35u) * 0x9E3779B1u) & mask & ~15u;
+            }
+        };
+
+    protected:
+        size_t hashBits;
+    };
+
+    /**
+     * \brief Chooses a method for each block by sampled entropy and match density,
+     * incompressible blocks are stored raw behind a one-byte marker.
+     */
+    class Auto : public ICoder
+    {
+
+    public:
+
+        Auto(size_t blockSize = 1024 * 1024)
+        {
+            this->blockSize = blockSize;
+        }
+
+        using ICoder::encode;
+        using ICoder::decode;
+
+        // block look like: <method, rawLen, [packedLen], data>
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+
+            for (size_t start = 0; start < text.size(); start += blockSize)
+            {
+                const size_t len = min(blockSize, text.size() - start);
+                const vector<char> block(text.begin() + start, text.begin() + start + len);
+
+                vector<char> packed;
+                char method = choose(block);
+                if (method != STORED)
+                {
+                    unique_ptr<ICoder> c(coder(method));
+                    c->encode(block, packed);
+
+                    // Never let a block grow, the packed length field has to pay off too.
+                    if (packed.size() + sizeof(uint32_t) >= len)
+                        method = STORED;
+                }
+
+                out.push_back(method);
+                put<uint32_t>(out, static_cast<uint32_t>(len));
+
+                if (method == STORED)
+                    out.insert(out.end(), block.begin(), block.end());
+                else
+                {
+                    put<uint32_t>(out, static_cast<uint32_t>(packed.size()));
+                    out.insert(out.end(), packed.begin(), packed.end());
+                }
+            }
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            out.clear();
+
+            while (pos < in.size())
+            {
+                const char method = get<char>(in, pos);
+                const uint32_t len = get<uint32_t>(in, pos);
+                const uint32_t size = method == STORED ? len : get<uint32_t>(in, pos);
+
+                if (size > in.size() - pos)
+                    throw runtime_error("Unexpected end of encoded data.");
+
+                if (method == STORED)
+                    out.insert(out.end(), in.begin() + pos, in.begin() + pos + size);
+                else
+                {
+                    const vector<char> packed(in.begin() + pos, in.begin() + pos + size);
+                    vector<char> block;
+
+                    unique_ptr<ICoder> c(coder(method));
+                    c->decode(packed, block);
+
+                    if (block.size() != len)
+                        throw runtime_error("Corrupted block of auto method.");
+                    out.insert(out.end(), block.begin(), block.end());
+                }
+
+                pos += size;
+            }
+        }
+
+        // Blocks never grow, each is coded by the hungriest block method at worst.
+        size_t memoryUsage(size_t size) const override
+        {
+            const size_t block = size < blockSize ? size : blockSize;
+            return saturate(grown(size, size) + LZ77<4 * 1024, 1 * 1024>().memoryUsage(block));
+        }
+
+        /** \brief Halves blocks down to 64 KB. */
+        void limitMemory(size_t limit, size_t size) override
+        {
+            while (blockSize > 64 * 1024 && memoryUsage(size) > limit)
+                blockSize /= 2;
+        }
+
+    private:
+
+        static const char STORED = 0;
+        static const char HUFFMAN = 1;
+        static const char LZ = 2;
+
+        static ICoder* coder(char method)
+        {
+            if (method == HUFFMAN)
+                return new Huffman();
+            if (method == LZ)
+                return new LZ77<4 * 1024, 1 * 1024>();
+
+            throw runtime_error("Unknown block method: " + to_string(method));
+        }
+
+        /** \brief Picks block method by a few evenly spaced samples. */
+        static char choose(const vector<char>& block)
+        {
+            const size_t SAMPLE_SIZE = 4 * 1024;
+            const size_t SAMPLE_COUNT = 4;
+
+            const size_t sampleSize = min(SAMPLE_SIZE, block.size());
+            const size_t count = block.size() > SAMPLE_SIZE * SAMPLE_COUNT ? SAMPLE_COUNT : 1;
+            const size_t step = count > 1 ? (block.size() - sampleSize) / (count - 1) : 0;
+
+            double entropy = 0;
+            double nodes = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                const char* sample = &block[i * step];
+                entropy += FileReader::entropy(sample, sampleSize);
+                nodes += nodeRatio(sample, sampleSize);
+            }
+            entropy /= count;
+            nodes /= count;
+
+            // Only long repeats pay for 5-byte LZ77 nodes, prefix codes take entropy bits per byte but one at least.
+            if (nodes * NODE_BYTES * 8 < max(entropy, 1.0))
+                return LZ;
+
+            // Compressed or random data: no skewed symbols left for prefix codes.
+            if (entropy > 7.5)
+                return STORED;
+
+            return HUFFMAN;
+        }
+
+        // Bytes of an LZ77 node of the block method: offset, length and literal.
+        static const size_t NODE_BYTES = 5;
+
+        /** \brief LZ77 nodes per byte of the sample by a greedy parse with the last position of each 4-byte hash. */
+        static double nodeRatio(const char* sample, size_t size)
+        {
+            if (size == 0)
+                return 0;
+
+            const uint32_t HASH_BITS = 12;
+            const size_t MAX_LEN = 1024;
+            vector<uint32_t> last(1 << HASH_BITS, UINT32_MAX);
+
+            size_t nodes = 0;
+            for (uint32_t i = 0; i < size; ++nodes)
+            {
+                size_t len = 0;
+                if (i + 4 < size)
+                {
+                    uint32_t v;
+                    memcpy(&v, sample + i, sizeof(v));
+
+                    const uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+                    if (last[h] != UINT32_MAX)
+                    {
+                        // Keep the last byte for the node literal.
+                        const char* his = sample + last[h];
+                        while (len < MAX_LEN && i + len + 1 < size && his[len] == sample[i + len])
+                            ++len;
+                    }
+                    last[h] = i;
+                }
+                i += static_cast<uint32_t>(len) + 1;
+            }
+
+            return static_cast<double>(nodes) / size;
+        }
+
+    protected:
+        size_t blockSize;
+    };
+
+    /**
+     * \brief Base of stages in front of any method: owns the wrapped coder and leaves it the memory
+     * limit without the part the stage takes itself.
+     */
+    class StageCoder : public ICoder
+    {
+
+    public:
+
+        using ICoder::encode;
+        using ICoder::decode;
+
+        void encode(const vector<char>& text, vector<char>& out) override
+        {
+            encode(text, out, 0);
+        }
+
+        void decode(const vector<char>& in, vector<char>& out) override
+        {
+            decode(in, 0, out);
+        }
+
+        size_t memoryUsage(size_t size) const override
+        {
+            return saturate(static_cast<uint64_t>(coder->bufferUsage(coded(size))) + own(size));
+        }
+
+        void limitMemory(size_t limit, size_t size) override
+        {
+            coder->limitMemory(limit > own(size) ? limit - own(size) : 0, coded(size));
+        }
+
+    protected:
+
+        /** \brief Takes ownership of coder. */
+        StageCoder(ICoder* coder) : coder(coder) {}
+
+        /** \brief Bytes taken by the stage itself to encode size bytes, the wrapped coder counts its own. */
+        virtual uint64_t own(size_t size) const = 0;
+
+        /** \brief Bytes the wrapped coder gets for size bytes of the source. */
+        virtual size_t coded(size_t size) const
+        {
+            return size;
+        }
+
+    protected:
+        unique_ptr<ICoder> coder;
+    };
+
+    /** \brief Adds CRC32C of encoded data and of each raw block to any method, decoding aborts on mismatch. */
+    class Checked : public StageCoder
+    {
+
+    public:
+
+        /** \brief Takes ownership of coder. */
+        Checked(ICoder* coder, size_t blockSize = 1024 * 1024) : StageCoder(coder)
+        {
+            this->blockSize = blockSize;
+        }
+
+        using StageCoder::encode;
+        using StageCoder::decode;
+
+        // block look like: <rawLen, blockSize, raw block crcs, packed crc, packed>
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            out.resize(pos);
+            put<uint64_t>(out, text.size());
+            put<uint32_t>(out, static_cast<uint32_t>(blockSize));
+            for (size_t start = 0; start < text.size(); start += blockSize)
+                put<uint32_t>(out, Checksum::crc32c(&text[start], min(blockSize, text.size() - start)));
+
+            // The packed crc is filled in after the wrapped coder.
+            const size_t crcPos = out.size();
+            put<uint32_t>(out, 0);
+            coder->encode(text, out, out.size());
+
+            const uint32_t packedCrc = Checksum::crc32c(&out[crcPos] + sizeof(uint32_t), out.size() - crcPos - sizeof(uint32_t));
+            memcpy(&out[crcPos], &packedCrc, sizeof(packedCrc));
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            const uint64_t rawLen = get<uint64_t>(in, pos);
+            const size_t blockSize = get<uint32_t>(in, pos);
+            if (blockSize == 0)
+                throw runtime_error("Corrupted checksum header.");
+
+            const uint64_t blocks = (rawLen + blockSize - 1) / blockSize;
+            if (blocks > (in.size() - pos) / sizeof(uint32_t))
+                throw runtime_error("Unexpected end of encoded data.");
+
+            vector<uint32_t> crcs(static_cast<size_t>(blocks));
+            for (auto& crc : crcs)
+                crc = get<uint32_t>(in, pos);
+
+            // Corrupted data is never handed to the decoder.
+            const uint32_t packedCrc = get<uint32_t>(in, pos);
+            if (Checksum::crc32c(in.data() + pos, in.size() - pos) != packedCrc)
+                throw runtime_error("Checksum mismatch of encoded data.");
+
+            coder->decode(in, pos, out);
+            if (out.size() != rawLen)
+                throw runtime_error("Decoded data length mismatch.");
+
+            for (size_t i = 0; i < crcs.size(); ++i)
+            {
+                const size_t start = i * blockSize;
+                if (Checksum::crc32c(&out[start], min(blockSize, out.size() - start)) != crcs[i])
+                    throw runtime_error("Checksum mismatch of decoded block " + to_string(i) + ".");
+            }
+        }
+
+    protected:
+
+        /** \brief The header with raw block checksums, it is put in front of the encoded data. */
+        uint64_t own(size_t size) const override
+        {
+            return (size / blockSize + 1) * sizeof(uint32_t) + 16;
+        }
 
-                if (s[s.length() - 1] == ':' && s[s.length() - 2] != ':')
-                {
-                    co = '\n';
-                    code = s.substr(0, s.length() - 1);
-                }
+    protected:
+        size_t blockSize;
+    };
+
+    /**
+     * \brief Run-length stage in front of any method: MIN_RUN equal bytes are followed by
+     * the variable length count of further repeats.
+     */
+    class RLE : public StageCoder
+    {
+
+    public:
+
+        /** \brief Takes ownership of coder. */
+        RLE(ICoder* coder) : StageCoder(coder) {}
+
+        using StageCoder::encode;
+        using StageCoder::decode;
+
+        // block look like: <runsLen, packed runs>
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            vector<char> runs;
+            runs.reserve(text.size());
+
+            const char* p = text.data();
+            const size_t n = text.size();
+            size_t i = 0;
+            while (i < n)
+            {
+                const size_t j = findPair(p, i, n);
+                runs.insert(runs.end(), p + i, p + j);
+                if (j == n)
+                    break;
+
+                const size_t run = runLength(p + j, n - j);
+                if (run < MIN_RUN)
+                    runs.insert(runs.end(), p + j, p + j + run);
                 else
                 {
-                    co = s[s.length() - 1];
-                    code = s.substr(0, s.length() - 2);
+                    runs.insert(runs.end(), MIN_RUN, p[j]);
+                    putVarint(runs, run - MIN_RUN);
                 }
-
-                m[code] = co;
+                i = j + run;
             }
 
-            // Decode.
+            out.resize(pos);
+            put<uint64_t>(out, runs.size());
+            coder->encode(runs, out, out.size());
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            const uint64_t runsLen = get<uint64_t>(in, pos);
+
+            vector<char> runs;
+            coder->decode(in, pos, runs);
+            if (runs.size() != runsLen)
+                throw runtime_error("Corrupted run-length data.");
 
-            string code = "";
-            string buf = "";
-            int k = 0;
-            while (!ifs.eof())
+            out.clear();
+            size_t equal = 0;
+            for (size_t i = 0; i < runs.size();)
             {
-                ifs.read(&c, 1);
-                code.append(byteToBinary(c));
+                const char c = runs[i++];
+                equal = !out.empty() && out.back() == c ? equal + 1 : 1;
+                out.push_back(c);
 
-                while (code.length() != 0 && k < code.length())
+                if (equal == MIN_RUN)
                 {
-                    buf += code[k];
-                    ++k;
-                    auto it = m.find(buf);
-                    if (it != m.end())
-                    {
-                        ofs.write(&it.operator*().second, 1);
-                        buf = "";
-                        code = code.substr(k);
-                        k = 0;
-                    }
+                    out.insert(out.end(), static_cast<size_t>(getVarint(runs, i)), c);
+                    equal = 0;
                 }
             }
+        }
 
-            ifs.close();
-            ofs.close();
+    protected:
+
+        /** \brief The source or the grown result, the coder counts runs. */
+        uint64_t own(size_t size) const override
+        {
+            return GROWTH * static_cast<uint64_t>(size);
+        }
+
+        // Runs are no longer than the source plus a quarter.
+        size_t coded(size_t size) const override
+        {
+            return size + size / 4;
         }
 
     private:
 
-        map<char, string> _map;
-        vector< pair< pair<int, char>, string> > _list;
+        static const size_t MIN_RUN = 4;
+
+        static unsigned int lowestBit(unsigned int mask)
+        {
+#if defined(_MSC_VER)
+            unsigned long i;
+            _BitScanForward(&i, mask);
+            return i;
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+
+        /** \brief First i >= from with p[i] == p[i + 1], or n if there is none. */
+        static size_t findPair(const char* p, size_t from, size_t n)
+        {
+#ifdef ENCODER_SSE2
+            for (; from + 17 <= n; from += 16)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + from));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + from + 1));
+                const unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+                if (mask != 0)
+                    return from + lowestBit(mask);
+            }
+#endif
+            for (; from + 1 < n; ++from)
+                if (p[from] == p[from + 1])
+                    return from;
+            return n;
+        }
+
+        /** \brief Number of leading bytes equal to p[0], n > 0. */
+        static size_t runLength(const char* p, size_t n)
+        {
+            size_t i = 1;
+#ifdef ENCODER_SSE2
+            const __m128i c = _mm_set1_epi8(p[0]);
+            for (; i + 16 <= n; i += 16)
+            {
+                const unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), c));
+                if (mask != 0xFFFF)
+                    return i + lowestBit(~mask);
+            }
+#endif
+            while (i < n && p[i] == p[0])
+                ++i;
+            return i;
+        }
     };
 
-    /** \brief LZ77 method with specific history and preview buffer encoder/decoder. */
-    class LZ77 : public ICoder
+    /**
+     * \brief Deduplication stage: content defined chunks are kept once across all files in the store
+     * storePath + ".pack" (chunks encoded by the wrapped method) and storePath + ".index".
+     * A store serves one wrapped method only, Encoder names it after the method.
+     */
+    class Dedup : public StageCoder
     {
 
     public:
 
-        LZ77(size_t hisBufSize, size_t preBufSize)
+        /** \brief Takes ownership of coder, which encodes each unique chunk. */
+        Dedup(ICoder* coder, const string& storePath) : StageCoder(coder)
         {
-            this->hisBufSize = hisBufSize;
-            this->preBufSize = preBufSize;
+            this->storePath = storePath;
+            loadIndex();
         }
 
-        void encode(const string& path, const string& pathTo) override
+        using StageCoder::encode;
+        using StageCoder::decode;
+
+        // block look like: <rawLen, count, chunk references <digest, len>>
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
         {
-            vector<char> text;
-            FileReader::readAllBytes(path, text);
+            out.resize(pos);
+            put<uint64_t>(out, text.size());
+            const size_t countPos = out.size();
+            put<uint64_t>(out, 0);
+
+            ofstream pack;
+            vector<char> index;
+            vector<char> chunk;
+            vector<char> packed;
+            uint64_t count = 0;
+            for (size_t start = 0; start < text.size(); ++count)
+            {
+                const char* data = &text[start];
+                ChunkKey key;
+                key.len = static_cast<uint32_t>(Chunker::cut(data, text.size() - start));
+                Chunker::fingerprint(data, key.len, key.digest);
 
-            ofstream ofs(pathTo, ofstream::binary);
-            if (!ofs.good())
-                throw runtime_error("Can't write to file: " + pathTo);
+                put<Chunker::Digest>(out, key.digest);
+                put<uint32_t>(out, key.len);
 
-            ofs.write((char*)&hisBufSize, sizeof(size_t));
+                if (chunks.find(key) == chunks.end())
+                {
+                    chunk.assign(data, data + key.len);
+                    coder->encode(chunk, packed);
 
-            size_t hisStart = 0;
-            size_t preStart = 0;
-            size_t hisEnd = 0;
-            size_t preEnd = preBufSize;
+                    if (!pack.is_open())
+                    {
+                        pack.open(storePath + ".pack", ios::binary | ios::app);
+                        if (!pack.good())
+                            throw runtime_error("Can't write to file: " + storePath + ".pack");
+                    }
+                    if (!packed.empty())
+                        pack.write(&packed[0], packed.size());
+
+                    // index record look like: <digest, len, offset, size>
+                    const ChunkEntry entry = { packSize, static_cast<uint32_t>(packed.size()) };
+                    put<Chunker::Digest>(index, key.digest);
+                    put<uint32_t>(index, key.len);
+                    put<uint64_t>(index, entry.offset);
+                    put<uint32_t>(index, entry.size);
+
+                    packSize += packed.size();
+                    chunks[key] = entry;
+                }
 
-            while (preStart < text.size())
+                start += key.len;
+            }
+            memcpy(&out[countPos], &count, sizeof(count));
+
+            // Chunks go first, so the index never refers to missing data.
+            if (pack.is_open())
             {
-                LZ77Node node = findNewNode(text, hisStart, hisEnd, preStart, preEnd);
+                pack.close();
+                if (pack.fail())
+                    throw runtime_error("Can't write to file: " + storePath + ".pack");
+                // New records go after the whole ones, a cut off tail would shift them.
+                if (indexTail)
+                {
+                    FileReader::truncateFile(storePath + ".index", static_cast<size_t>(indexSize));
+                    indexTail = false;
+                }
+                FileReader::writeBytes(storePath + ".index", index);
+                indexSize += index.size();
+            }
+        }
 
-                ofs.write((char*)&node.offs, sizeof(short));
-                ofs.write((char*)&node.len, sizeof(short));
-                ofs.write(&node.ch, sizeof(char));
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            const uint64_t rawLen = get<uint64_t>(in, pos);
+            const uint64_t count = get<uint64_t>(in, pos);
 
-                hisEnd += node.len + 1;
-                preStart += node.len + 1;
-                preEnd += node.len + 1;
+            ifstream ifs(storePath + ".pack", ios::binary);
+            if (count > 0 && !ifs.good())
+                throw runtime_error("Can't read from file: " + storePath + ".pack");
 
-                if (hisEnd - hisStart > hisBufSize)
-                    hisStart += hisEnd - hisStart - hisBufSize;
+            out.clear();
+            out.reserve(static_cast<size_t>(rawLen));
+
+            vector<char> packed;
+            vector<char> chunk;
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                ChunkKey key;
+                key.digest = get<Chunker::Digest>(in, pos);
+                key.len = get<uint32_t>(in, pos);
+
+                auto it = chunks.find(key);
+                if (it == chunks.end())
+                    throw runtime_error("Chunk is missing in the store: " + storePath);
+
+                packed.resize(it->second.size);
+                ifs.seekg(it->second.offset, ios::beg);
+                if (!packed.empty())
+                    ifs.read(&packed[0], packed.size());
+                if (!ifs.good())
+                    throw runtime_error("Can't read chunk from file: " + storePath + ".pack");
+
+                coder->decode(packed, chunk);
+                if (chunk.size() != key.len)
+                    throw runtime_error("Corrupted chunk in the store: " + storePath);
+                out.insert(out.end(), chunk.begin(), chunk.end());
             }
-            ofs.close();
+
+            if (out.size() != rawLen)
+                throw runtime_error("Decoded data length differs from encoded.");
         }
 
-        void decode(const string& path, const string& pathTo) override
+    protected:
+
+        /** \brief Source or result and references of all chunks, new chunks go to the pack file one by one. */
+        uint64_t own(size_t size) const override
         {
-            ifstream ifs(path, ifstream::binary);
-            if (!ifs.good())
-                throw runtime_error("Can't read from file: " + path);
+            const uint64_t count = size / Chunker::MIN_SIZE + 1;
+            return size + (count + chunks.size()) * CHUNK_BYTES;
+        }
 
-            ofstream ofs(pathTo, ofstream::binary);
-            if (!ofs.good())
-                throw runtime_error("Can't write to file: " + pathTo);
+        // Chunks are coded one by one, the store index stays in memory.
+        size_t coded(size_t /* size */) const override
+        {
+            return Chunker::MAX_SIZE;
+        }
+
+    private:
+
+        // Bytes of a chunk reference, an index record and a hash map entry of the chunk.
+        static const size_t CHUNK_BYTES = 192;
+        // Bytes of an index record <digest, len, offset, size>.
+        static const size_t INDEX_RECORD = sizeof(Chunker::Digest) + 4 + 8 + 4;
 
-            size_t hisBufSize = 0;
-            ifs.read((char*)&hisBufSize, sizeof(size_t));
+        struct ChunkKey
+        {
+            Chunker::Digest digest;
+            uint32_t len;
 
-            string hisBuf;
-            while (!ifs.eof())
+            bool operator==(const ChunkKey& k) const
             {
-                ushort offs = 0;
-                ushort len = 0;
-                char ch = 0;
+                return len == k.len && memcmp(digest.bytes, k.digest.bytes, sizeof(digest.bytes)) == 0;
+            }
+        };
 
-                ifs.read((char*)&offs, sizeof(short));
-                ifs.read((char*)&len, sizeof(short));
-                ifs.read(&ch, sizeof(char));
+        struct ChunkKeyHash
+        {
+            size_t operator()(const ChunkKey& k) const
+            {
+                // Bytes of a SHA-256 digest are uniform already.
+                size_t h;
+                memcpy(&h, k.digest.bytes, sizeof(h));
+                return h;
+            }
+        };
 
-                size_t hisStart = hisBuf.size() - offs;
+        struct ChunkEntry
+        {
+            uint64_t offset;
+            uint32_t size;
+        };
 
-                for (int j = 0; j < len; ++j)
-                    hisBuf += hisBuf[hisStart + j];
+        void loadIndex()
+        {
+            ifstream pack(storePath + ".pack", ios::binary | ios::ate);
+            packSize = pack.good() ? static_cast<uint64_t>(pack.tellg()) : 0;
+            indexSize = 0;
+            indexTail = false;
 
-                hisBuf += ch;
+            ifstream ifs(storePath + ".index", ios::binary);
+            if (!ifs.good())
+                return;
+            ifs.close();
 
-                ofs.write(&hisBuf[hisStart], len);
-                ofs.write(&ch, sizeof(char));
+            vector<char> index;
+            FileReader::readAllBytes(storePath + ".index", index);
 
-                if (hisBuf.size() > hisBufSize)
-                    hisBuf = hisBuf.substr(hisBuf.size() - hisBufSize);
+            // A record cut off by an interrupted write is skipped as well as one out of the pack.
+            size_t pos = 0;
+            while (index.size() - pos >= INDEX_RECORD)
+            {
+                ChunkKey key;
+                ChunkEntry entry;
+                key.digest = get<Chunker::Digest>(index, pos);
+                key.len = get<uint32_t>(index, pos);
+                entry.offset = get<uint64_t>(index, pos);
+                entry.size = get<uint32_t>(index, pos);
+
+                if (entry.offset + entry.size <= packSize)
+                    chunks[key] = entry;
             }
-            ifs.close();
-            ofs.close();
+            indexSize = pos;
+            indexTail = pos != index.size();
         }
 
     private:
+        unordered_map<ChunkKey, ChunkEntry, ChunkKeyHash> chunks;
+        uint64_t packSize;
+        // Length of the whole records of the index file, and whether an incomplete record follows them.
+        uint64_t indexSize;
+        bool indexTail;
 
-        typedef unsigned short ushort;
+    protected:
+        string storePath;
+    };
 
-        // block look like:  <offs, len, ch> example: <3,2,d>
-        struct LZ77Node
+    /**
+     * \brief Delta stage in front of any method: each byte is replaced by its difference with the byte
+     * stride positions back, so slowly changing fields of fixed width records turn into small values.
+     * Stride 0 picks the stride by samples of the data, or leaves the data as is.
+     */
+    class Delta : public StageCoder
+    {
+
+    public:
+
+        /** \brief Takes ownership of coder. */
+        Delta(ICoder* coder, size_t stride) : StageCoder(coder)
         {
-            ushort offs;
-            ushort len;
-            char ch;
+            this->stride = stride;
+        }
 
-            LZ77Node(ushort o, ushort l, char c) : offs(o), len(l), ch(c) { }
-        };
+        using StageCoder::encode;
+        using StageCoder::decode;
+
+        // block look like: <rawLen, stride, packed differences>
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            const size_t s = stride != 0 ? stride : detectStride(text);
+
+            out.resize(pos);
+            put<uint64_t>(out, text.size());
+            put<uint32_t>(out, static_cast<uint32_t>(s));
+
+            if (s == 0)
+                coder->encode(text, out, out.size());
+            else
+            {
+                vector<char> filtered(text.size());
+                if (!text.empty())
+                    deltaEncode(text.data(), &filtered[0], text.size(), s);
+                coder->encode(filtered, out, out.size());
+            }
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            const uint64_t rawLen = get<uint64_t>(in, pos);
+            const size_t s = get<uint32_t>(in, pos);
+
+            coder->decode(in, pos, out);
+            if (out.size() != rawLen)
+                throw runtime_error("Corrupted delta data.");
+
+            if (s != 0 && !out.empty())
+                deltaDecode(&out[0], out.size(), s);
+        }
+
+    protected:
 
-        LZ77Node findNewNode(const vector<char>& text, size_t hisStart, size_t hisEnd, size_t preStart, size_t preEnd)
+        /** \brief The source next to its differences, which the coder counts, decoding works in place. */
+        uint64_t own(size_t size) const override
         {
-            ushort hisSize = hisEnd - hisStart;
-            ushort preSize = preEnd - preStart;
+            return size;
+        }
+
+    private:
 
-            ushort curHisIndex = 0;
-            ushort maxSeqStartIndex = 0;
-            ushort maxSeqLength = 0;
+        /** \brief Writes differences of n bytes of src with the bytes stride back to dst. */
+        static void deltaEncode(const char* src, char* dst, size_t n, size_t stride)
+        {
+            size_t i = 0;
+            for (; i < stride && i < n; ++i)
+                dst[i] = src[i];
+#ifdef ENCODER_SSE2
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i - stride));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_sub_epi8(a, b));
+            }
+#endif
+            for (; i < n; ++i)
+                dst[i] = static_cast<char>(src[i] - src[i - stride]);
+        }
 
-            while (curHisIndex < hisSize && curHisIndex < preSize)
+        /** \brief Restores n bytes of p from differences in place. */
+        static void deltaDecode(char* p, size_t n, size_t stride)
+        {
+            size_t i = stride;
+#ifdef ENCODER_SSE2
+            if (stride >= 16)
             {
-                ushort tHisIndex = curHisIndex;
-                ushort tPreIndex = 0;
-                ushort readSeqLength = 0;
+                // Bytes stride back are restored before the vector reads them.
+                for (; i + 16 <= n; i += 16)
+                {
+                    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i - stride));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), _mm_add_epi8(a, b));
+                }
+            }
+            else if (stride == 1 || stride == 2 || stride == 4 || stride == 8)
+            {
+                for (; i < 16 && i < n; ++i)
+                    p[i] = static_cast<char>(p[i] + p[i - stride]);
 
-                while (tHisIndex < hisSize && tPreIndex < preSize && tPreIndex < text.size() &&
-                    text[hisStart + tHisIndex] == text[preStart + tPreIndex])
+                for (; i + 16 <= n; i += 16)
                 {
-                    ++tHisIndex;
-                    ++tPreIndex;
-                    ++readSeqLength;
+                    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                    const __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i - 16));
+                    x = _mm_add_epi8(prefixSum(x, stride), carry(prev, p + i, stride));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), x);
+                }
+            }
+#endif
+            for (; i < n; ++i)
+                p[i] = static_cast<char>(p[i] + p[i - stride]);
+        }
+
+#ifdef ENCODER_SSE2
+
+        /** \brief Sums of bytes of x stride apart within the vector, stride is 1, 2, 4 or 8. */
+        static __m128i prefixSum(__m128i x, size_t stride)
+        {
+            if (stride <= 1)
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+            if (stride <= 2)
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+            if (stride <= 4)
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        }
+
+        /** \brief The last stride restored bytes before p repeated over the vector. */
+        static __m128i carry(__m128i prev, const char* p, size_t stride)
+        {
+            if (stride == 1)
+                return _mm_set1_epi8(p[-1]);
+            if (stride == 2)
+            {
+                int16_t v;
+                memcpy(&v, p - 2, sizeof(v));
+                return _mm_set1_epi16(v);
+            }
+            if (stride == 4)
+            {
+                int32_t v;
+                memcpy(&v, p - 4, sizeof(v));
+                return _mm_set1_epi32(v);
+            }
+            return _mm_unpackhi_epi64(prev, prev);
+        }
+
+#endif
+
+        /** \brief Picks the stride whose differences have the least entropy in a few samples, 0 if none pays off. */
+        static size_t detectStride(const vector<char>& text)
+        {
+            const size_t SAMPLE_SIZE = 16 * 1024;
+            const size_t SAMPLE_COUNT = 4;
+            const size_t STRIDES[] = { 1, 2, 3, 4, 6, 8, 12, 16 };
+
+            // Order-0 entropy ignores contexts the method finds in raw data, so differences must win clearly.
+            const double MIN_GAIN = 0.5;
+
+            if (text.size() < 2 * 16)
+                return 0;
+
+            const size_t sampleSize = min(SAMPLE_SIZE, text.size());
+            const size_t count = text.size() > SAMPLE_SIZE * SAMPLE_COUNT ? SAMPLE_COUNT : 1;
+            const size_t step = count > 1 ? (text.size() - sampleSize) / (count - 1) : 0;
 
-                    if (tHisIndex == hisSize)
-                        tHisIndex = curHisIndex;
+            double best = 0;
+            for (size_t i = 0; i < count; ++i)
+                best += FileReader::entropy(&text[i * step], sampleSize) / count;
+            best -= MIN_GAIN;
+
+            size_t bestStride = 0;
+            vector<char> residuals(sampleSize);
+            for (size_t s : STRIDES)
+            {
+                double entropy = 0;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    deltaEncode(&text[i * step], &residuals[0], sampleSize, s);
+                    entropy += FileReader::entropy(residuals.data(), sampleSize) / count;
                 }
 
-                if (readSeqLength > maxSeqLength)
+                if (entropy < best)
                 {
-                    maxSeqLength = readSeqLength;
-                    maxSeqStartIndex = curHisIndex;
+                    best = entropy;
+                    bestStride = s;
                 }
-                ++curHisIndex;
             }
+            return bestStride;
+        }
 
-            if (maxSeqLength == 0)
-                return LZ77Node(0, 0, text[preStart]);
+    protected:
+        size_t stride;
+    };
+
+    /**
+     * \brief Byte-plane transposition stage in front of any method: bytes of width-byte elements are
+     * grouped by their position in the element, so equal high bytes of numbers form long runs.
+     * Bytes after the last whole element are kept as is.
+     */
+    class Shuffle : public StageCoder
+    {
+
+    public:
+
+        /** \brief Takes ownership of coder, width is 2, 4 or 8. */
+        Shuffle(ICoder* coder, size_t width) : StageCoder(coder)
+        {
+            if (width != 2 && width != 4 && width != 8)
+                throw logic_error("Shuffle element width must be 2, 4 or 8.");
+            this->width = width;
+        }
+
+        using StageCoder::encode;
+        using StageCoder::decode;
+
+        // block look like: <rawLen, width, packed planes>
+        void encode(const vector<char>& text, vector<char>& out, size_t pos) override
+        {
+            vector<char> planes(text.size());
+            if (!text.empty())
+                shuffle(text.data(), &planes[0], text.size(), width);
+
+            out.resize(pos);
+            put<uint64_t>(out, text.size());
+            put<uint8_t>(out, static_cast<uint8_t>(width));
+            coder->encode(planes, out, out.size());
+        }
+
+        void decode(const vector<char>& in, size_t pos, vector<char>& out) override
+        {
+            const uint64_t rawLen = get<uint64_t>(in, pos);
+            const size_t w = get<uint8_t>(in, pos);
+            if (w != 2 && w != 4 && w != 8)
+                throw runtime_error("Corrupted shuffle header.");
+
+            vector<char> planes;
+            coder->decode(in, pos, planes);
+            if (planes.size() != rawLen)
+                throw runtime_error("Corrupted shuffled data.");
+
+            out.resize(static_cast<size_t>(rawLen));
+            if (!out.empty())
+                unshuffle(planes.data(), &out[0], out.size(), w);
+        }
+
+    protected:
+
+        /** \brief The source next to its planes, which the coder counts. */
+        uint64_t own(size_t size) const override
+        {
+            return size;
+        }
+
+    private:
+
+        /** \brief Writes byte planes of n bytes of src to dst, plane j takes byte j of every element. */
+        static void shuffle(const char* src, char* dst, size_t n, size_t width)
+        {
+            const size_t count = n / width;
+            size_t e = 0;
+#ifdef ENCODER_SSE2
+            // 16 elements at a time.
+            for (; e + 16 <= count; e += 16)
+            {
+                __m128i v[8];
+                for (size_t k = 0; k < width; ++k)
+                    v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + e * width + k * 16));
 
-            return LZ77Node(hisSize - maxSeqStartIndex, maxSeqLength, text[preStart + maxSeqLength]);
+                deinterleave(v, width);
+                for (size_t j = 0; j < width; ++j)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + j * count + e), v[j]);
+            }
+#endif
+            for (; e < count; ++e)
+                for (size_t j = 0; j < width; ++j)
+                    dst[j * count + e] = src[e * width + j];
+
+            memcpy(dst + count * width, src + count * width, n - count * width);
+        }
+
+        /** \brief Restores n bytes of elements from byte planes of src to dst. */
+        static void unshuffle(const char* src, char* dst, size_t n, size_t width)
+        {
+            const size_t count = n / width;
+            size_t e = 0;
+#ifdef ENCODER_SSE2
+            for (; e + 16 <= count; e += 16)
+            {
+                __m128i v[8];
+                for (size_t j = 0; j < width; ++j)
+                    v[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + j * count + e));
+
+                interleave(v, width);
+                for (size_t k = 0; k < width; ++k)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + e * width + k * 16), v[k]);
+            }
+#endif
+            for (; e < count; ++e)
+                for (size_t j = 0; j < width; ++j)
+                    dst[e * width + j] = src[j * count + e];
+
+            memcpy(dst + count * width, src + count * width, n - count * width);
+        }
+
+#ifdef ENCODER_SSE2
+
+        /**
+         * \brief Transposes width vectors of 16 elements into width planes. A round splits each pair of
+         * vectors into even and odd bytes, after log2(width) rounds vector j holds byte j of all elements.
+         */
+        static void deinterleave(__m128i* v, size_t width)
+        {
+            const __m128i low = _mm_set1_epi16(0x00FF);
+            const size_t half = width / 2;
+            __m128i t[8];
+            for (size_t round = 1; round < width; round *= 2)
+            {
+                for (size_t i = 0; i < half; ++i)
+                {
+                    t[i] = _mm_packus_epi16(_mm_and_si128(v[2 * i], low), _mm_and_si128(v[2 * i + 1], low));
+                    t[half + i] = _mm_packus_epi16(_mm_srli_epi16(v[2 * i], 8), _mm_srli_epi16(v[2 * i + 1], 8));
+                }
+                copy(t, t + width, v);
+            }
+        }
+
+        /** \brief Inverse of deinterleave, each round merges even and odd bytes back. */
+        static void interleave(__m128i* v, size_t width)
+        {
+            const size_t half = width / 2;
+            __m128i t[8];
+            for (size_t round = 1; round < width; round *= 2)
+            {
+                for (size_t i = 0; i < half; ++i)
+                {
+                    t[2 * i] = _mm_unpacklo_epi8(v[i], v[half + i]);
+                    t[2 * i + 1] = _mm_unpackhi_epi8(v[i], v[half + i]);
+                }
+                copy(t, t + width, v);
+            }
         }
 
+#endif
+
     protected:
-        size_t hisBufSize;
-        size_t preBufSize;
+        size_t width;
     };
+
+public:
+
+    typedef function<ICoder*()> Factory;
+    typedef function<ICoder*(ICoder* coder, const string& storePath)> Stage;
+
+    /** \brief Registers factory of method, replaces a factory registered with the same name. */
+    static void add(const string& method, Factory factory)
+    {
+        methods()[method] = factory;
+    }
+
+    /**
+     * \brief Registers stage which wraps any method as "stage+method", the stage owns the wrapped coder.
+     * Stages keeping data across files put it to files starting with storePath.
+     */
+    static void addStage(const string& stage, Stage wrap)
+    {
+        stages()[stage] = wrap;
+    }
+
+private:
+
+    /** \brief Registry of method factories by method name. */
+    static unordered_map<string, Factory>& methods()
+    {
+        static unordered_map<string, Factory> m =
+        {
+            { "haff", []() -> ICoder* { return new Huffman(); } },
+            { "haffmt", []() -> ICoder* { return new Huffman(64 * 1024); } },
+            { "adapt", []() -> ICoder* { return new Adaptive(); } },
+            { "shan", []() -> ICoder* { return new ShannonFano(); } },
+            { "lz775", []() -> ICoder* { return new LZ77<4 * 1024, 1 * 1024>(); } },
+            { "lz7710", []() -> ICoder* { return new LZ77<8 * 1024, 2 * 1024>(); } },
+            { "lz7720", []() -> ICoder* { return new LZ77<16 * 1024, 4 * 1024>(); } },
+            { "lz77app", []() -> ICoder* { return new LZ77Append<16 * 1024, 4 * 1024>(); } },
+            { "lz77long", []() -> ICoder* { return new LZ77Long<4 * 1024, 1 * 1024>(256 * 1024 * 1024, 22); } },
+            { "bwt", []() -> ICoder* { return new BWT(); } },
+            { "cm", []() -> ICoder* { return new ContextMix(); } },
+            { "auto", []() -> ICoder* { return new Auto(); } },
+        };
+        return m;
+    }
+
+    /** \brief Registry of stages by prefix name. */
+    static unordered_map<string, Stage>& stages()
+    {
+        static unordered_map<string, Stage> m =
+        {
+            { "crc", [](ICoder* c, const string&) -> ICoder* { return new Checked(c); } },
+            { "rle", [](ICoder* c, const string&) -> ICoder* { return new RLE(c); } },
+            { "dedup", [](ICoder* c, const string& store) -> ICoder* { return new Dedup(c, store); } },
+            { "delta", [](ICoder* c, const string&) -> ICoder* { return new Delta(c, 0); } },
+            { "delta1", [](ICoder* c, const string&) -> ICoder* { return new Delta(c, 1); } },
+            { "delta2", [](ICoder* c, const string&) -> ICoder* { return new Delta(c, 2); } },
+            { "delta3", [](ICoder* c, const string&) -> ICoder* { return new Delta(c, 3); } },
+            { "delta4", [](ICoder* c, const string&) -> ICoder* { return new Delta(c, 4); } },
+            { "delta8", [](ICoder* c, const string&) -> ICoder* { return new Delta(c, 8); } },
+            { "shuffle2", [](ICoder* c, const string&) -> ICoder* { return new Shuffle(c, 2); } },
+            { "shuffle4", [](ICoder* c, const string&) -> ICoder* { return new Shuffle(c, 4); } },
+            { "shuffle8", [](ICoder* c, const string&) -> ICoder* { return new Shuffle(c, 8); } },
+        };
+        return m;
+    }
+
+    /** \brief Creates coder by method name or returns nullptr, "stage+method" wraps method by stage. */
+    ICoder* create(const string& method) const
+    {
+        const size_t plus = method.find('+');
+        if (plus != string::npos)
+        {
+            auto stage = stages().find(method.substr(0, plus));
+            if (stage == stages().end())
+                return nullptr;
+
+            const string wrapped = method.substr(plus + 1);
+            ICoder* c = create(wrapped);
+            return c ? stage->second(c, storeDirectory + stage->first + "." + wrapped) : nullptr;
+        }
+
+        auto it = methods().find(method);
+        return it != methods().end() ? it->second() : nullptr;
+    }
+
+    size_t memoryLimit = SIZE_MAX;
+    string storeDirectory;
+
+    /** \brief Lets coder fit into the memory limit for the source with path, throws if it can't. */
+    void fit(ICoder& c, const string& method, const string& path) const
+    {
+        // Without a limit the source is never measured, so pipes are read only by the coder.
+        if (memoryLimit == SIZE_MAX)
+            return;
+
+        const size_t size = sourceSize(c, path);
+        c.limitMemory(memoryLimit, size);
+        check(method, c.memoryUsage(size));
+    }
+
+    /** \brief Size of the source with path for the estimates of c, 0 if they don't depend on it. */
+    static size_t sourceSize(const ICoder& c, const string& path)
+    {
+        // Streaming coders take the same for any source, which may be a pipe that can't be measured.
+        if (c.memoryUsage(0) == c.memoryUsage(static_cast<size_t>(1) << 30))
+            return 0;
+        return FileReader::fileSize(path);
+    }
+
+    /** \brief Throws if method needs more than the memory limit. */
+    void check(const string& method, size_t need) const
+    {
+        if (need > memoryLimit)
+            throw runtime_error("Method " + method + " needs " + to_string(need) + " bytes, the memory limit is " + to_string(memoryLimit) + ".");
+    }
 };
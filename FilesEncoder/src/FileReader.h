@@ -4,6 +4,17 @@
 #include <vector>
 #include <fstream>
 #include <map>
+#include <cmath>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
 
 // It's ok here.
 using namespace std;
@@ -23,6 +34,8 @@ public:
         const ifstream::pos_type pos = ifs.tellg();
 
         read = vector<char>(pos);
+        if (read.empty())
+            return;
 
         // Read from begining of the file.
         ifs.seekg(0, ios::beg);
@@ -31,6 +44,34 @@ public:
         ifs.close();
     }
 
+    /** \brief Gets size of the file in bytes. */
+    static size_t fileSize(const string& path)
+    {
+        ifstream ifs(path, ios::binary | ios::ate);
+        if (!ifs.good())
+            throw runtime_error("Can't read from file: " + path);
+        return static_cast<size_t>(ifs.tellg());
+    }
+
+    /** \brief Reads bytes from offset to the end of the file into \code vector<char> read \endcode, returns the file size. */
+    static size_t readBytesFrom(const string& path, size_t offset, vector<char>& read)
+    {
+        ifstream ifs(path, ios::binary | ios::ate);
+        if (!ifs.good())
+            throw runtime_error("Can't read from file: " + path);
+        const size_t size = static_cast<size_t>(ifs.tellg());
+
+        read = vector<char>(size > offset ? size - offset : 0);
+        if (!read.empty())
+        {
+            ifs.seekg(offset, ios::beg);
+            ifs.read(&read[0], read.size());
+        }
+
+        ifs.close();
+        return size;
+    }
+
     /** \brief Writes all bytes from \code vector<char> write \endcode into the file. */
     static void writeBytes(const string& path, vector<char>& write)
     {
@@ -45,6 +86,48 @@ public:
         ofs.close();
     }
 
+    /** \brief Rewrites the file with all bytes from \code vector<char> write \endcode. */
+    static void writeAllBytes(const string& path, const vector<char>& write)
+    {
+        ofstream ofs(path, ios::binary | ios::trunc);
+        if (!ofs.good())
+            throw runtime_error("Can't write to file: " + path);
+
+        if (!write.empty())
+            ofs.write(&write[0], write.size());
+
+        ofs.close();
+    }
+
+    /** \brief Cuts the file down to size bytes. */
+    static void truncateFile(const string& path, size_t size)
+    {
+#ifdef _WIN32
+        int fd = -1;
+        if (_sopen_s(&fd, path.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0)
+            throw runtime_error("Can't write to file: " + path);
+
+        const int error = _chsize_s(fd, static_cast<__int64>(size));
+        _close(fd);
+        if (error != 0)
+            throw runtime_error("Can't truncate file: " + path);
+#else
+        if (truncate(path.c_str(), static_cast<off_t>(size)) != 0)
+            throw runtime_error("Can't truncate file: " + path);
+#endif
+    }
+
+    /** \brief Moves the file with pathFrom over the file with path. */
+    static void replaceFile(const string& pathFrom, const string& path)
+    {
+#ifdef _WIN32
+        // CRT rename doesn't overwrite an existing file.
+        remove(path.c_str());
+#endif
+        if (rename(pathFrom.c_str(), path.c_str()) != 0)
+            throw runtime_error("Can't replace file: " + path);
+    }
+
     /** \brief Reads all file to the char map quantity. */
     static void readSymbolsMap(const string& path, map<char, int>& m)
     {
@@ -63,6 +146,19 @@ public:
         ifs.close();
     }
 
+    /** \brief Counts all bytes of text to the char map quantity. */
+    static void readSymbolsMap(const vector<char>& text, map<char, int>& m)
+    {
+        int counts[256] = {};
+        for (char c : text)
+            ++counts[static_cast<unsigned char>(c)];
+
+        m = map<char, int>();
+        for (int i = 0; i < 256; ++i)
+            if (counts[i] > 0)
+                m[static_cast<char>(i)] = counts[i];
+    }
+
     /** \brief Writes string with new line. */
     static void writeString(const string& path, string write)
     {
@@ -95,6 +191,26 @@ public:
         return entropy;
     }
 
+    /** \brief Gets entropy of size bytes starting at data. */
+    static double entropy(const char* data, size_t size)
+    {
+        double entropy = 0;
+
+        size_t counts[256] = {};
+        for (size_t i = 0; i < size; ++i)
+            ++counts[static_cast<unsigned char>(data[i])];
+
+        for (size_t c : counts)
+        {
+            if (c == 0)
+                continue;
+            double r = static_cast<double>(c) / size;
+            entropy -= r * log2(r);
+        }
+
+        return entropy;
+    }
+
     /** \brief Calculates file size / encodedFile size. */
     static double compressRatio(const string& file, const string& encodedFile)
     {
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// It's ok here.
+using namespace std;
+
+/**
+ * \brief Counts bytes taken by the global operator new. The program routes its global
+ * allocation functions to allocate/release once, see main.cpp.
+ */
+class MemoryCounter
+{
+
+public:
+
+    /** \brief Allocates size bytes and counts them, throws bad_alloc on failure. */
+    static void* allocate(size_t size)
+    {
+        char* p = static_cast<char*>(malloc(size + HEADER));
+        if (!p)
+            throw bad_alloc();
+
+        // The size is kept in front of the block for release.
+        *reinterpret_cast<size_t*>(p) = size;
+
+        const size_t now = current().fetch_add(size) + size;
+        size_t was = peakBytes().load();
+        while (now > was && !peakBytes().compare_exchange_weak(was, now)) {}
+
+        return p + HEADER;
+    }
+
+    /** \brief Releases block given by allocate. */
+    static void release(void* block)
+    {
+        if (!block)
+            return;
+
+        char* p = static_cast<char*>(block) - HEADER;
+        current().fetch_sub(*reinterpret_cast<size_t*>(p));
+        free(p);
+    }
+
+    /** \brief Gets bytes allocated now. */
+    static size_t allocated()
+    {
+        return current().load();
+    }
+
+    /** \brief Gets the largest number of bytes allocated at once since the last reset. */
+    static size_t peak()
+    {
+        return peakBytes().load();
+    }
+
+    /** \brief Starts measuring the peak from bytes allocated now. */
+    static void resetPeak()
+    {
+        peakBytes().store(current().load());
+    }
+
+private:
+
+    // Keeps blocks aligned as malloc does on all supported platforms.
+    static const size_t HEADER = 16;
+
+    static atomic<size_t>& current()
+    {
+        static atomic<size_t> bytes(0);
+        return bytes;
+    }
+
+    static atomic<size_t>& peakBytes()
+    {
+        static atomic<size_t> bytes(0);
+        return bytes;
+    }
+
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+// It's ok here.
+using namespace std;
+
+/** \brief Binary adaptive range encoder, probabilities of bit 0 are PROB_BITS wide. */
+class RangeEncoder
+{
+
+public:
+
+    static const int PROB_BITS = 12;
+    static const uint32_t PROB_INIT = 1 << (PROB_BITS - 1);
+
+    /** \brief Encoded bytes are appended to out. */
+    RangeEncoder(vector<char>& out) : out(out) {}
+
+    /** \brief Encodes bit with probability p of zero, p is in (0, 1 << PROB_BITS). */
+    void encodeBit(int bit, uint32_t p)
+    {
+        const uint32_t bound = (range >> PROB_BITS) * p;
+        if (bit == 0)
+            range = bound;
+        else
+        {
+            low += bound;
+            range -= bound;
+        }
+        normalize();
+    }
+
+    /** \brief Encodes bit and moves adaptive probability prob towards it by 1 / 2^shift. */
+    void encode(int bit, uint16_t& prob, int shift = 5)
+    {
+        encodeBit(bit, prob);
+        if (bit == 0)
+            prob += ((1 << PROB_BITS) - prob) >> shift;
+        else
+            prob -= prob >> shift;
+    }
+
+    /** \brief Encodes lower bits of value with equal probabilities, the high bit first. */
+    void encodeDirect(uint32_t value, int bits)
+    {
+        while (bits-- > 0)
+        {
+            range >>= 1;
+            if ((value >> bits) & 1)
+                low += range;
+            normalize();
+        }
+    }
+
+    /** \brief Writes the rest of the state, the encoder can't be used afterwards. */
+    void flush()
+    {
+        for (int i = 0; i < 5; ++i)
+            shiftLow();
+    }
+
+private:
+
+    void normalize()
+    {
+        while (range < (1u << 24))
+        {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    // Delays bytes while a carry may still change them.
+    void shiftLow()
+    {
+        if (static_cast<uint32_t>(low) < 0xFF000000u || (low >> 32) != 0)
+        {
+            const char carry = static_cast<char>(low >> 32);
+            char c = cache;
+            do
+            {
+                out.push_back(static_cast<char>(c + carry));
+                c = static_cast<char>(0xFF);
+            } while (--cacheSize != 0);
+            cache = static_cast<char>(low >> 24);
+        }
+        ++cacheSize;
+        low = (low & 0x00FFFFFFu) << 8;
+    }
+
+private:
+    vector<char>& out;
+    uint64_t low = 0;
+    uint32_t range = 0xFFFFFFFFu;
+    char cache = 0;
+    uint64_t cacheSize = 1;
+};
+
+/** \brief Decoder for RangeEncoder output from memory or from a stream. */
+class RangeDecoder
+{
+
+public:
+
+    static const int PROB_BITS = RangeEncoder::PROB_BITS;
+
+    /** \brief Decodes size bytes of data. */
+    RangeDecoder(const char* data, size_t size) : cur(data), end(data + size)
+    {
+        init();
+    }
+
+    /** \brief Decodes bytes of is, reading it by chunks. */
+    RangeDecoder(istream& is) : is(&is), buf(64 * 1024)
+    {
+        init();
+    }
+
+    /** \brief Decodes bit with probability p of zero. */
+    int decodeBit(uint32_t p)
+    {
+        const uint32_t bound = (range >> PROB_BITS) * p;
+        int bit;
+        if (code < bound)
+        {
+            range = bound;
+            bit = 0;
+        }
+        else
+        {
+            code -= bound;
+            range -= bound;
+            bit = 1;
+        }
+        normalize();
+        return bit;
+    }
+
+    /** \brief Decodes bit and updates adaptive probability prob like the encoder does. */
+    int decode(uint16_t& prob, int shift = 5)
+    {
+        const int bit = decodeBit(prob);
+        if (bit == 0)
+            prob += ((1 << PROB_BITS) - prob) >> shift;
+        else
+            prob -= prob >> shift;
+        return bit;
+    }
+
+    /** \brief Decodes value of bits equally probable bits. */
+    uint32_t decodeDirect(int bits)
+    {
+        uint32_t value = 0;
+        while (bits-- > 0)
+        {
+            range >>= 1;
+            const uint32_t bit = code >= range;
+            if (bit)
+                code -= range;
+            value = (value << 1) | bit;
+            normalize();
+        }
+        return value;
+    }
+
+private:
+
+    void init()
+    {
+        for (int i = 0; i < 5; ++i)
+            code = (code << 8) | next();
+    }
+
+    void normalize()
+    {
+        while (range < (1u << 24))
+        {
+            range <<= 8;
+            code = (code << 8) | next();
+        }
+    }
+
+    uint8_t next()
+    {
+        if (cur == end)
+        {
+            if (!is)
+                throw runtime_error("Unexpected end of range coded data.");
+
+            is->read(&buf[0], buf.size());
+            if (is->gcount() == 0)
+                throw runtime_error("Unexpected end of range coded data.");
+            cur = &buf[0];
+            end = cur + is->gcount();
+        }
+        return static_cast<uint8_t>(*cur++);
+    }
+
+private:
+    const char* cur = nullptr;
+    const char* end = nullptr;
+    istream* is = nullptr;
+    vector<char> buf;
+
+    uint32_t range = 0xFFFFFFFFu;
+    uint32_t code = 0;
+};
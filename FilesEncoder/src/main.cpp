@@ -6,13 +6,36 @@
  * Encoder.h - encode / decode.
  * FileReader.h - write / read files. Size, entropy.
  * Timer.h - nanoseconds timer.
+ * MemoryCounter.h - allocated and peak memory.
+ * Checksum.h - CRC32C checksum.
+ * RangeCoder.h - binary adaptive range coder.
+ * Chunker.h - content defined chunking, chunk fingerprints.
  * main.cpp - experiment.
  */
 
 #include "Encoder.h"
 #include "Timer.h"
+#include "MemoryCounter.h"
 #include <iostream>
 
+// All allocations are counted to report peak memory of each method.
+void* operator new(size_t size) { return MemoryCounter::allocate(size); }
+void* operator new[](size_t size) { return MemoryCounter::allocate(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept
+{
+    try { return MemoryCounter::allocate(size); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept
+{
+    try { return MemoryCounter::allocate(size); } catch (...) { return nullptr; }
+}
+void operator delete(void* p) noexcept { MemoryCounter::release(p); }
+void operator delete[](void* p) noexcept { MemoryCounter::release(p); }
+void operator delete(void* p, size_t) noexcept { MemoryCounter::release(p); }
+void operator delete[](void* p, size_t) noexcept { MemoryCounter::release(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { MemoryCounter::release(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { MemoryCounter::release(p); }
+
 const string SOURCE_FOLDER = "source/";
 const string OUT_FOLDER = "out/";
 const string CSV_OUT = "result.csv";
@@ -24,15 +47,19 @@ const int FILES_LEN = 1;
 
 const string FILES_PATH[] = { "02" };
 
-const int METHOD_COUNT = 5;
+const int METHOD_COUNT = 13;
 
-const string METHOD_NAMES[] = { "haff", "shan", "lz775", "lz7710", "lz7720" };
+const string METHOD_NAMES[] = { "haff", "haffmt", "rle+haff", "shan", "lz775", "lz7710", "lz7720", "lz77long", "bwt", "shuffle4+delta+bwt", "adapt", "cm", "auto" };
 
 const int n = 1;
 
+// Methods pick smaller windows, blocks or tables to fit, SIZE_MAX - no limit.
+const size_t MEMORY_LIMIT = SIZE_MAX;
+
 int main()
 {
     Encoder e;
+    e.setMemoryLimit(MEMORY_LIMIT);
     Timer t;
 
     ofstream f(CSV_OUT, ios::out);
@@ -46,6 +73,8 @@ int main()
         f << "coef " << METHOD_NAMES[i] << ";";
         f << "time pack " << METHOD_NAMES[i] << ";";
         f << "time unpack " << METHOD_NAMES[i] << ";";
+        f << "peak pack " << METHOD_NAMES[i] << ";";
+        f << "peak unpack " << METHOD_NAMES[i] << ";";
     }
 
     f << "\n";
@@ -63,23 +92,32 @@ int main()
         for (int m = 0; m < METHOD_COUNT; ++m)
         {
             std::cout << "File: " << FILES_PATH[i] << endl << "method: " << METHOD_NAMES[m] << endl;
+            std::cout << "estimated memory: " << e.memoryUsage(METHOD_NAMES[m], SOURCE_FOLDER + FILES_PATH[i]) << endl;
 
             long long eTime = 0;
             long long deTime = 0;
+            size_t ePeak = 0;
+            size_t dePeak = 0;
 
             for (int c = 0; c < n; ++c)
             {
                 // Code.
+                size_t base = MemoryCounter::allocated();
+                MemoryCounter::resetPeak();
                 t.start();
                 e.encode(METHOD_NAMES[m], SOURCE_FOLDER + FILES_PATH[i], OUT_FOLDER + FILES_PATH[i] + "." + METHOD_NAMES[m]);
                 t.stop();
                 eTime += t.result();
+                ePeak = max(ePeak, MemoryCounter::peak() - base);
 
                 // Decode.
+                base = MemoryCounter::allocated();
+                MemoryCounter::resetPeak();
                 t.start();
                 e.decode(METHOD_NAMES[m], OUT_FOLDER + FILES_PATH[i] + "." + METHOD_NAMES[m], OUT_FOLDER + FILES_PATH[i] + ".un" + METHOD_NAMES[m]);
                 t.stop();
                 deTime += t.result();
+                dePeak = max(dePeak, MemoryCounter::peak() - base);
             }
 
             // Write compress ratio.
@@ -92,6 +130,9 @@ int main()
             f << eTime << ";";
             // Write averege decode time.
             f << deTime << ";";
+            // Write peak bytes allocated by encoding and decoding.
+            f << ePeak << ";";
+            f << dePeak << ";";
         }
 
         f << "\n";